@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2025 - 2025 ENCRYPTED SUPPORT LLC <adrelanos@whonix.org>
+ * See the file COPYING for copying conditions.
+ */
+
+/*
+ * kloak-bench replays an input trace, as written by kloak --record-trace,
+ * through the same scheduling code kloak runs, without any input devices or
+ * compositor. It reports throughput, CPU time per event, and the scheduling
+ * error distributions from kloak's metrics.
+ *
+ * By default the replay runs on a simulated clock: the bench jumps straight
+ * to the next event or release deadline, as if the release timer fired with
+ * a fixed, configurable slack. With --realtime the trace is replayed at its
+ * recorded pace against the real clock instead, which includes the kernel's
+ * actual timer behavior in the lateness figures.
+ */
+
+#define KLOAK_BENCH
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "kloak.c"
+
+#define BENCH_DEFAULT_SYNTHETIC_EVENTS 200000
+#define BENCH_SIM_EPOCH_US 1000000
+
+static struct trace_record *bench_records = NULL;
+static size_t bench_record_count = 0;
+static size_t bench_record_capacity = 0;
+
+static int64_t bench_slack_us = 0;
+static bool bench_realtime = false;
+static struct histogram bench_queue_cpu_ns = { 0 };
+static uint64_t bench_release_cpu_ns = 0;
+static uint64_t bench_input_events = 0;
+static int64_t bench_last_sched_us = 0;
+
+static int64_t thread_cpu_time_ns(void) {
+  struct timespec spec;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &spec);
+  return (spec.tv_sec) * 1000000000 + spec.tv_nsec;
+}
+
+static void bench_push_record(const struct trace_record *rec) {
+  if (bench_record_count == bench_record_capacity) {
+    size_t new_capacity = bench_record_capacity
+      ? bench_record_capacity * 2 : 1024;
+    struct trace_record *new_records = reallocarray(bench_records,
+      new_capacity, sizeof(struct trace_record));
+    if (new_records == NULL) {
+      fprintf(stderr, "FATAL ERROR: Could not allocate memory for trace!\n");
+      exit(1);
+    }
+    bench_records = new_records;
+    bench_record_capacity = new_capacity;
+  }
+  bench_records[bench_record_count++] = *rec;
+}
+
+static void bench_load_trace(const char *path) {
+  uint8_t header[TRACE_HEADER_SIZE];
+  uint8_t buf[TRACE_RECORD_SIZE];
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "FATAL ERROR: Could not open trace file '%s': %s\n",
+      path, strerror(errno));
+    exit(1);
+  }
+  if (fread(header, 1, sizeof(header), file) != sizeof(header)
+    || memcmp(header, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0
+    || load_le32(header + TRACE_MAGIC_SIZE) != TRACE_VERSION) {
+    fprintf(stderr, "FATAL ERROR: '%s' is not a version %d kloak trace!\n",
+      path, TRACE_VERSION);
+    exit(1);
+  }
+  while (fread(buf, 1, sizeof(buf), file) == sizeof(buf)) {
+    struct trace_record rec;
+    trace_decode_record(buf, &rec);
+    bench_push_record(&rec);
+  }
+  fclose(file);
+}
+
+/*
+ * Builds a reproducible trace of two side-by-side 1920x1080 outputs, a mouse
+ * reporting at 1000 Hz that wanders across both, and typing at roughly eight
+ * keys per second.
+ */
+static void bench_synthesize_trace(size_t event_count) {
+  uint64_t seed = 0x9e3779b97f4a7c15;
+  struct trace_record rec = { 0 };
+  int64_t next_key_us = 0;
+  int64_t now_us = 0;
+  int64_t last_us = 0;
+  uint32_t key = 30;
+  bool key_down = false;
+
+  rec.type = TRACE_RECORD_OUTPUT;
+  rec.arg = 1;
+  rec.c = 1920;
+  rec.d = 1080;
+  bench_push_record(&rec);
+  rec.arg = 0;
+  rec.a = 1920;
+  bench_push_record(&rec);
+
+  for (size_t i = 0; i < event_count; ++i) {
+    /* xorshift64, good enough for test input */
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    memset(&rec, 0, sizeof(rec));
+    if (now_us >= next_key_us) {
+      rec.type = TRACE_RECORD_KEY;
+      rec.a = (int32_t) key;
+      rec.arg = key_down ? 0 : 1;
+      if (key_down) {
+        key = 16 + (uint32_t) (seed % 35);
+        next_key_us = now_us + 40000 + (int64_t) (seed % 120000);
+      } else {
+        next_key_us = now_us + 30000 + (int64_t) (seed % 60000);
+      }
+      key_down = !key_down;
+    } else {
+      rec.type = TRACE_RECORD_MOTION;
+      rec.a = (int32_t) (seed % 4097) - 2048;
+      rec.b = (int32_t) ((seed >> 16) % 2049) - 1024;
+      now_us += 1000;
+    }
+    rec.time_delta_us = (uint32_t) (now_us - last_us);
+    last_us = now_us;
+    bench_push_record(&rec);
+  }
+}
+
+static void bench_set_layout(size_t first, size_t end) {
+  while (state.layer_count > 0) {
+    struct drawable_layer *layer = state.layers[state.layer_count - 1];
+    remove_drawable_layer(&state, layer);
+    free(layer);
+  }
+  for (size_t i = first; i < end; ++i) {
+    struct drawable_layer *layer = calloc(1, sizeof(struct drawable_layer));
+    if (layer == NULL) {
+      fprintf(stderr,
+        "FATAL ERROR: Could not allocate memory for drawable layer!\n");
+      exit(1);
+    }
+    layer->state = &state;
+    insert_drawable_layer(&state, layer);
+    layer->geometry.x = bench_records[i].a;
+    layer->geometry.y = bench_records[i].b;
+    layer->geometry.width = bench_records[i].c;
+    layer->geometry.height = bench_records[i].d;
+    layer->geometry_valid = true;
+  }
+  schedule_global_space_recalc(&state, true);
+  recalc_global_space(&state);
+
+  /* Start the cursor in the middle of the first output. */
+  if (state.layer_count > 0) {
+    struct output_geometry *geometry = &state.layers[0]->geometry;
+    seats[0].cursor_x = seats[0].prev_cursor_x
+      = geometry->x + geometry->width / 2;
+    seats[0].cursor_y = seats[0].prev_cursor_y
+      = geometry->y + geometry->height / 2;
+  }
+}
+
+static void bench_sleep_until(int64_t time_us) {
+  struct timespec spec = {
+    .tv_sec = time_us / 1000000,
+    .tv_nsec = (time_us % 1000000) * 1000,
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &spec, NULL)
+    == EINTR);
+}
+
+/*
+ * Releases everything that falls due up to and including until_us, the way
+ * the main loop would if the release timer fired bench_slack_us late. An
+ * event arriving at until_us wakes the loop early, so no release happens
+ * later than that.
+ */
+static void bench_release_until(int64_t until_us) {
+  struct input_packet *packet;
+  while ((packet = packet_ring_first(&seats[0].packet_queue))) {
+    int64_t deadline = packet->sched_time;
+    if (deadline > until_us)
+      break;
+    int64_t now;
+    if (bench_realtime) {
+      bench_sleep_until(deadline);
+      now = current_time_us();
+    } else {
+      now = min(deadline + bench_slack_us, until_us);
+    }
+    int64_t cpu_start = thread_cpu_time_ns();
+    release_scheduled_input_events(&seats[0], now);
+    bench_release_cpu_ns += (uint64_t) (thread_cpu_time_ns() - cpu_start);
+  }
+}
+
+/*
+ * Every queued event has to be released no earlier than it was read, and
+ * no earlier than the packet queued before it, or the queue stops being a
+ * FIFO.
+ */
+static void bench_check_release_order(int64_t now) {
+  struct input_packet *tail = packet_ring_last(&seats[0].packet_queue);
+  if (!tail)
+    return;
+  if (tail->sched_time < now || tail->sched_time < bench_last_sched_us) {
+    fprintf(stderr,
+      "FATAL ERROR: Packet %" PRIu32 " read at %" PRId64 " is scheduled for"
+      " %" PRId64 ", before the previous release at %" PRId64 " or now!\n",
+      tail->id, now, tail->sched_time, bench_last_sched_us);
+    exit(1);
+  }
+  bench_last_sched_us = tail->sched_time;
+}
+
+static void bench_replay(void) {
+  int64_t base_us = bench_realtime ? current_time_us() : BENCH_SIM_EPOCH_US;
+  int64_t offset_us = 0;
+
+  for (size_t i = 0; i < bench_record_count; ++i) {
+    const struct trace_record *rec = &bench_records[i];
+    offset_us += rec->time_delta_us;
+    int64_t event_time = base_us + offset_us;
+
+    if (rec->type == TRACE_RECORD_OUTPUT) {
+      if (!(rec->arg & 1))
+        continue;
+      size_t end = i + 1;
+      while (end < bench_record_count
+        && bench_records[end].type == TRACE_RECORD_OUTPUT
+        && !(bench_records[end].arg & 1))
+        ++end;
+      bench_set_layout(i, end);
+      continue;
+    }
+
+    struct decoded_event ev;
+    if (!trace_record_to_input_event(rec, event_time, &ev))
+      continue;
+    bench_release_until(event_time);
+    int64_t now = event_time;
+    if (bench_realtime) {
+      bench_sleep_until(event_time);
+      now = current_time_us();
+    }
+    int64_t cpu_start = thread_cpu_time_ns();
+    queue_input_event_and_relocate_virtual_cursor(&seats[0], &ev, now);
+    histogram_record(&bench_queue_cpu_ns, thread_cpu_time_ns() - cpu_start);
+    bench_check_release_order(now);
+    ++bench_input_events;
+  }
+  bench_release_until(INT64_MAX);
+}
+
+static void bench_print_usage(void) {
+  fprintf(stderr,
+    "Usage: kloak-bench [options] [trace-file]\n");
+  fprintf(stderr,
+    "Replays a trace recorded with 'kloak --record-trace' through kloak's\n");
+  fprintf(stderr,
+    "scheduler. Without a trace file, a synthetic trace is generated.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr,
+    "Options:\n");
+  fprintf(stderr,
+    "  -d, --delay=milliseconds          maximum delay, as for kloak.\n");
+  fprintf(stderr,
+    "  -a, --adaptive-delay              use the adaptive delay window.\n");
+  fprintf(stderr,
+    "  -f, --delay-floor=milliseconds    adaptive delay floor.\n");
+  fprintf(stderr,
+    "  -n, --events=count                size of the synthetic trace.\n");
+  fprintf(stderr,
+    "                                    Default 200000.\n");
+  fprintf(stderr,
+    "  -l, --slack=microseconds          simulated timer lateness. Default 0.\n");
+  fprintf(stderr,
+    "  -r, --realtime                    replay at the recorded pace.\n");
+  fprintf(stderr,
+    "  -b, --backend=null|counting       output backend. Default null.\n");
+  fprintf(stderr,
+    "  -h, --help                        print help\n");
+}
+
+int main(int argc, char **argv) {
+  const char *optstring = "d:af:n:l:rb:h";
+  int32_t delay_floor = DEFAULT_DELAY_FLOOR_MS;
+  size_t synthetic_events = BENCH_DEFAULT_SYNTHETIC_EVENTS;
+  static struct option optarr[] = {
+    {"delay", required_argument, NULL, 'd'},
+    {"adaptive-delay", no_argument, NULL, 'a'},
+    {"delay-floor", required_argument, NULL, 'f'},
+    {"events", required_argument, NULL, 'n'},
+    {"slack", required_argument, NULL, 'l'},
+    {"realtime", no_argument, NULL, 'r'},
+    {"backend", required_argument, NULL, 'b'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0}
+  };
+  int getopt_rslt;
+
+  while(1) {
+    getopt_rslt = getopt_long(argc, argv, optstring, optarr, NULL);
+    if (getopt_rslt == -1) {
+      break;
+    } else if (getopt_rslt == 'd') {
+      max_delay = parse_uintarg("delay", optarg);
+    } else if (getopt_rslt == 'a') {
+      adaptive_delay.enabled = true;
+    } else if (getopt_rslt == 'f') {
+      delay_floor = parse_uintarg("delay-floor", optarg);
+    } else if (getopt_rslt == 'n') {
+      synthetic_events = (size_t) parse_uintarg("events", optarg);
+    } else if (getopt_rslt == 'l') {
+      bench_slack_us = parse_uintarg("slack", optarg);
+    } else if (getopt_rslt == 'r') {
+      bench_realtime = true;
+    } else if (getopt_rslt == 'b') {
+      if (strcmp(optarg, "null") == 0) {
+        backend = &null_backend;
+      } else if (strcmp(optarg, "counting") == 0) {
+        backend = &counting_backend;
+      } else {
+        fprintf(stderr,
+          "FATAL ERROR: Unknown backend '%s', expected null or counting!\n",
+          optarg);
+        exit(1);
+      }
+    } else if (getopt_rslt == 'h') {
+      bench_print_usage();
+      exit(0);
+    } else {
+      bench_print_usage();
+      exit(1);
+    }
+  }
+  adaptive_delay.floor_us = (int64_t) min(delay_floor, max_delay) * 1000;
+
+  if (optind < argc) {
+    bench_load_trace(argv[optind]);
+  } else {
+    bench_synthesize_trace(synthetic_events);
+  }
+
+  applayer_random_init();
+  /* Traces hold a single seat. */
+  add_seat(DEFAULT_SEAT);
+  packet_ring_init(&seats[0].packet_queue, PACKET_RING_INITIAL_CAPACITY);
+  seats[0].adaptive_delay = adaptive_delay;
+
+  int64_t wall_start = current_time_ns();
+  int64_t cpu_start = thread_cpu_time_ns();
+  bench_replay();
+  double wall_s = (double) (current_time_ns() - wall_start) / 1e9;
+  double cpu_s = (double) (thread_cpu_time_ns() - cpu_start) / 1e9;
+
+  fprintf(stderr, "kloak bench: mode=%s events=%" PRIu64 " packets=%" PRIu64
+    " wall_s=%.3f cpu_s=%.3f events_per_cpu_s=%.0f"
+    " queue_cpu_ns_per_event=%.1f release_cpu_ns_per_packet=%.1f\n",
+    bench_realtime ? "realtime" : "simulated", bench_input_events,
+    metrics.packets_released, wall_s, cpu_s,
+    cpu_s > 0 ? bench_input_events / cpu_s : 0,
+    bench_input_events
+      ? (double) bench_queue_cpu_ns.sum / bench_input_events : 0,
+    metrics.packets_released
+      ? (double) bench_release_cpu_ns / metrics.packets_released : 0);
+  dump_histogram("queue_cpu_ns", &bench_queue_cpu_ns);
+  dump_histogram("input_to_release_us", &metrics.input_to_release_us);
+  dump_histogram("release_lateness_us", &metrics.release_lateness_us);
+  dump_histogram("queue_depth", &metrics.queue_depth);
+  dump_histogram("update_cursor_ns", &metrics.update_cursor_ns);
+  dump_backend_stats();
+  return 0;
+}
@@ -3,8 +3,12 @@
  * See the file COPYING for copying conditions.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -12,14 +16,30 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <poll.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <time.h>
 #include <math.h>
-#include <sys/queue.h>
 #include <getopt.h>
+#include <sys/random.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef KLOAK_USDT
+#include <sys/sdt.h>
+#endif
 
 #include <wayland-client.h>
 #include "xdg-output-protocol.h"
@@ -38,46 +58,203 @@
 /* global variables */
 /********************/
 
-static double cursor_x = 0;
-static double cursor_y = 0;
-static double prev_cursor_x = 0;
-static double prev_cursor_y = 0;
 
 static struct disp_state state = { 0 };
-static struct libinput *li;
 static struct udev *udev_ctx;
 
-static struct pollfd *ev_fds;
+static int epoll_fd = -1;
+static int release_timer_fd = -1;
+static int signal_fd = -1;
+static int64_t armed_release_deadline = -1;
+static uint64_t loop_wakeups = 0;
+static uint64_t timer_wakeups = 0;
 
-static int64_t prev_release_time = 0;
 static int32_t max_delay = DEFAULT_MAX_DELAY_MS;
 static int32_t startup_delay = DEFAULT_STARTUP_TIMEOUT_MS;
-static TAILQ_HEAD(tailhead, input_packet) head;
-
-int randfd;
+/* --input-budget, 0 drains all input every iteration */
+static size_t input_budget = DEFAULT_INPUT_BUDGET;
+static struct startup_timing startup = { 0 };
+static enum render_mode render_mode = RENDER_MODE_FULL;
+/* --adaptive-delay settings, copied into each seat */
+static struct adaptive_delay adaptive_delay = { 0 };
+static struct metrics metrics = { 0 };
+static struct trace_writer trace_writer = { 0 };
+static struct probe_log probe_log = { 0 };
+static uint32_t next_packet_id = 1;
+static struct backend_counters backend_counters = { 0 };
+static struct uinput_device uinput_device = { .fd = -1 };
+
+static bool threaded_capture = false;
+static struct realtime_config realtime = { .policy = SCHED_FIFO };
+#ifdef KLOAK_BENCH
+static const struct output_backend *backend = &null_backend;
+#else
+static const struct output_backend *backend = &wayland_backend;
+#endif
+static struct seat_context seats[MAX_SEATS];
+static size_t seat_count = 0;
+
+static uint64_t pointer_frames_sent = 0;
+static uint64_t modifier_updates_sent = 0;
+static uint64_t modifier_updates_skipped = 0;
+
+static struct csprng_state rng = { 0 };
+static struct cursor_sprite cursor_sprite = { 0 };
 
 /*********************/
 /* utility functions */
 /*********************/
 
+static uint32_t load_le32(const uint8_t *p) {
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16)
+    | ((uint32_t) p[3] << 24);
+}
+
+static void store_le32(uint8_t *p, uint32_t val) {
+  p[0] = (uint8_t) val;
+  p[1] = (uint8_t) (val >> 8);
+  p[2] = (uint8_t) (val >> 16);
+  p[3] = (uint8_t) (val >> 24);
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA20_QR(a, b, c, d) \
+  a += b; d ^= a; d = ROTL32(d, 16); \
+  c += d; b ^= c; b = ROTL32(b, 12); \
+  a += b; d ^= a; d = ROTL32(d, 8); \
+  c += d; b ^= c; b = ROTL32(b, 7);
+
+static void chacha20_block(const uint32_t input[16], uint8_t output[64]) {
+  uint32_t x[16];
+  memcpy(x, input, sizeof(x));
+  for (int32_t i = 0; i < 10; ++i) {
+    CHACHA20_QR(x[0], x[4], x[8], x[12]);
+    CHACHA20_QR(x[1], x[5], x[9], x[13]);
+    CHACHA20_QR(x[2], x[6], x[10], x[14]);
+    CHACHA20_QR(x[3], x[7], x[11], x[15]);
+    CHACHA20_QR(x[0], x[5], x[10], x[15]);
+    CHACHA20_QR(x[1], x[6], x[11], x[12]);
+    CHACHA20_QR(x[2], x[7], x[8], x[13]);
+    CHACHA20_QR(x[3], x[4], x[9], x[14]);
+  }
+  for (int32_t i = 0; i < 16; ++i) {
+    store_le32(output + i * 4, x[i] + input[i]);
+  }
+  explicit_bzero(x, sizeof(x));
+}
+
+static void read_os_random(uint8_t *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t ret = getrandom(buf + done, len - done, 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr,
+        "FATAL ERROR: Could not read %zu byte(s) from getrandom: %s\n", len,
+        strerror(errno));
+      exit(1);
+    }
+    done += (size_t) ret;
+  }
+}
+
+static void csprng_reseed(void) {
+  uint8_t seed[CHACHA20_KEY_SIZE + CHACHA20_NONCE_SIZE];
+  read_os_random(seed, sizeof(seed));
+  /* "expand 32-byte k" */
+  rng.input[0] = 0x61707865;
+  rng.input[1] = 0x3320646e;
+  rng.input[2] = 0x79622d32;
+  rng.input[3] = 0x6b206574;
+  /* Mix the fresh entropy into the existing key rather than replacing it, so
+   * a weak getrandom() result can never make the state worse. */
+  for (int32_t i = 0; i < 8; ++i) {
+    rng.input[4 + i] ^= load_le32(seed + i * 4);
+  }
+  rng.input[12] = 0;
+  rng.input[13] = 0;
+  rng.input[14] ^= load_le32(seed + CHACHA20_KEY_SIZE);
+  rng.input[15] ^= load_le32(seed + CHACHA20_KEY_SIZE + 4);
+  explicit_bzero(seed, sizeof(seed));
+  rng.bytes_since_reseed = 0;
+}
+
+static void csprng_refill(void) {
+  if (rng.bytes_since_reseed >= CSPRNG_RESEED_BYTES) {
+    csprng_reseed();
+  }
+  for (size_t i = 0; i < CSPRNG_BUF_SIZE; i += 64) {
+    chacha20_block(rng.input, rng.buf + i);
+    if (++rng.input[12] == 0)
+      ++rng.input[13];
+  }
+  /*
+   * Fast key erasure: the first bytes of every refill become the next key
+   * and are never handed out, so a later compromise of the process memory
+   * cannot be used to recover values that were already consumed.
+   */
+  for (int32_t i = 0; i < 8; ++i) {
+    rng.input[4 + i] = load_le32(rng.buf + i * 4);
+  }
+  rng.input[12] = 0;
+  rng.input[13] = 0;
+  explicit_bzero(rng.buf, CHACHA20_KEY_SIZE);
+  rng.buf_pos = CHACHA20_KEY_SIZE;
+  rng.bytes_since_reseed += CSPRNG_BUF_SIZE - CHACHA20_KEY_SIZE;
+}
+
 static void read_random(char *buf, size_t len) {
-  if (read(randfd, buf, len) < len) {
-    fprintf(stderr,
-      "FATAL ERROR: Could not read %d byte(s) from /dev/urandom!\n", len);
-    exit(1);
+  while (len > 0) {
+    if (rng.buf_pos == CSPRNG_BUF_SIZE) {
+      csprng_refill();
+    }
+    size_t chunk = min(len, CSPRNG_BUF_SIZE - rng.buf_pos);
+    memcpy(buf, rng.buf + rng.buf_pos, chunk);
+    /* Consumed keystream is wiped so it can't be read back later. */
+    explicit_bzero(rng.buf + rng.buf_pos, chunk);
+    rng.buf_pos += chunk;
+    buf += chunk;
+    len -= chunk;
+  }
+}
+
+static uint64_t random_uniform(uint64_t bound) {
+  if (bound <= 1) {
+    return 0;
+  }
+
+  if (bound <= UINT32_MAX) {
+    /*
+     * Lemire's nearly-divisionless method. Only 32 bits are consumed per
+     * draw, so a single buffer refill covers a few hundred delays.
+     */
+    uint32_t randval;
+    read_random((char *) &randval, sizeof(randval));
+    uint64_t product = (uint64_t) randval * bound;
+    uint32_t low = (uint32_t) product;
+    if (low < bound) {
+      uint32_t threshold = (uint32_t) (-(uint32_t) bound) % (uint32_t) bound;
+      while (low < threshold) {
+        read_random((char *) &randval, sizeof(randval));
+        product = (uint64_t) randval * bound;
+        low = (uint32_t) product;
+      }
+    }
+    return product >> 32;
   }
+
+  uint64_t randval;
+  uint64_t threshold = -bound % bound;
+  do {
+    read_random((char *) &randval, sizeof(randval));
+  } while (randval < threshold);
+  return randval % bound;
 }
 
 static void randname(char *buf, size_t len) {
-  char randchar = 0;
   for (size_t i = 0; i < len; ++i) {
-    do {
-      read_random(&randchar, 1);
-      if (randchar & 0x80)
-        randchar ^= 0x80;
-    } while (randchar >= (127 - 127 % 52));
-
-    randchar %= 52;
+    char randchar = (char) random_uniform(52);
     if (randchar < 26) {
       randchar += 65;
     } else {
@@ -122,15 +299,38 @@ static int create_shm_file(size_t size) {
   return fd;
 }
 
-static int64_t current_time_ms(void) {
+static int64_t current_time_us(void) {
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return (spec.tv_sec) * 1000000 + (spec.tv_nsec) / 1000;
+}
+
+static int64_t current_time_ns(void) {
   struct timespec spec;
   clock_gettime(CLOCK_MONOTONIC, &spec);
-  return (spec.tv_sec) * 1000 + (spec.tv_nsec) / 1000000;
+  return (spec.tv_sec) * 1000000000 + spec.tv_nsec;
+}
+
+static int64_t libinput_event_time_us(enum libinput_event_type ev_type,
+  struct libinput_event *li_event) {
+  switch (ev_type) {
+    case LIBINPUT_EVENT_POINTER_MOTION:
+    case LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE:
+    case LIBINPUT_EVENT_POINTER_BUTTON:
+    case LIBINPUT_EVENT_POINTER_SCROLL_WHEEL:
+    case LIBINPUT_EVENT_POINTER_SCROLL_FINGER:
+    case LIBINPUT_EVENT_POINTER_SCROLL_CONTINUOUS:
+      return (int64_t) libinput_event_pointer_get_time_usec(
+        libinput_event_get_pointer_event(li_event));
+    case LIBINPUT_EVENT_KEYBOARD_KEY:
+      return (int64_t) libinput_event_keyboard_get_time_usec(
+        libinput_event_get_keyboard_event(li_event));
+    default:
+      return -1;
+  }
 }
 
 static int64_t random_between(int64_t lower, int64_t upper) {
-  uint64_t maxval;
-  union rand_uint64 randval;
   /* default to max if the interval is not valid */
   if (lower >= upper) {
     return upper;
@@ -139,17 +339,7 @@ static int64_t random_between(int64_t lower, int64_t upper) {
     return 0;
   }
 
-  maxval = upper - lower + 1;
-  do {
-    read_random(randval.raw, sizeof(uint64_t));
-  } while (randval.val >= (UINT64_MAX - UINT64_MAX % maxval));
-
-  randval.val %= maxval;
-  uint64_t out_val = lower + randval.val;
-  if (out_val > INT64_MAX) {
-    return 0;
-  }
-  return (int64_t) lower + randval.val;
+  return lower + (int64_t) random_uniform((uint64_t) (upper - lower) + 1);
 }
 
 static bool check_point_in_area(uint32_t x, uint32_t y, uint32_t rect_x,
@@ -210,36 +400,113 @@ static bool check_screen_touch(struct output_geometry scr1,
   return false;
 }
 
+static size_t topology_find(struct output_topology *topo, size_t idx) {
+  while (topo->parent[idx] != idx) {
+    /* Path halving */
+    topo->parent[idx] = topo->parent[topo->parent[idx]];
+    idx = topo->parent[idx];
+  }
+  return idx;
+}
+
+static void topology_union(struct output_topology *topo, size_t a,
+  size_t b) {
+  size_t root_a = topology_find(topo, a);
+  size_t root_b = topology_find(topo, b);
+  if (root_a == root_b)
+    return;
+  if (topo->rank[root_a] < topo->rank[root_b]) {
+    size_t tmp = root_a;
+    root_a = root_b;
+    root_b = tmp;
+  }
+  topo->parent[root_b] = root_a;
+  if (topo->rank[root_a] == topo->rank[root_b])
+    ++topo->rank[root_a];
+  --topo->components;
+}
+
+static void schedule_global_space_recalc(struct disp_state *state,
+  bool rebuild) {
+  state->topology.dirty = true;
+  if (rebuild)
+    state->topology.needs_rebuild = true;
+}
+
 static void recalc_global_space(struct disp_state * state) {
+  struct output_topology *topo = &state->topology;
   uint32_t ul_corner_x = UINT32_MAX;
   uint32_t ul_corner_y = UINT32_MAX;
   uint32_t br_corner_x = 0;
   uint32_t br_corner_y = 0;
 
-  struct output_geometry *screen_list[MAX_DRAWABLE_LAYERS];
-  size_t screen_list_len = 0;
+  if (!topo->dirty)
+    return;
+  topo->dirty = false;
+
+  if (topo->capacity < state->layer_capacity) {
+    free(topo->parent);
+    free(topo->rank);
+    topo->capacity = state->layer_capacity;
+    topo->parent = calloc(topo->capacity, sizeof(size_t));
+    topo->rank = calloc(topo->capacity, sizeof(size_t));
+    if (topo->parent == NULL || topo->rank == NULL) {
+      fprintf(stderr,
+        "FATAL ERROR: Could not allocate memory for output topology!\n");
+      exit(1);
+    }
+    /* Indices into the old arrays are gone, start over. */
+    topo->needs_rebuild = true;
+  }
+  if (topo->needs_rebuild) {
+    for (size_t i = 0; i < state->layer_count; ++i)
+      state->layers[i]->topology_joined = false;
+    topo->components = 0;
+    topo->needs_rebuild = false;
+  }
+
+  rebuild_output_index(state);
 
-  for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-    if (!state->output_geometries[i])
+  for (size_t i = 0; i < state->layer_count; ++i) {
+    struct drawable_layer *layer = state->layers[i];
+    if (!layer->geometry_valid)
       continue;
-    screen_list[screen_list_len] = state->output_geometries[i];
-    ++screen_list_len;
-    if (state->output_geometries[i]->x < ul_corner_x) {
-      ul_corner_x = state->output_geometries[i]->x;
-    }
-    if (state->output_geometries[i]->y < ul_corner_y) {
-      ul_corner_y = state->output_geometries[i]->y;
-    }
-    uint32_t temp_br_x
-      = state->output_geometries[i]->x + state->output_geometries[i]->width;
-    uint32_t temp_br_y
-      = state->output_geometries[i]->y + state->output_geometries[i]->height;
+    struct output_geometry *geometry = &layer->geometry;
+    if (geometry->x < ul_corner_x) {
+      ul_corner_x = geometry->x;
+    }
+    if (geometry->y < ul_corner_y) {
+      ul_corner_y = geometry->y;
+    }
+    uint32_t temp_br_x = geometry->x + geometry->width;
+    uint32_t temp_br_y = geometry->y + geometry->height;
     if (temp_br_x > br_corner_x) {
       br_corner_x = temp_br_x;
     }
     if (temp_br_y > br_corner_y) {
       br_corner_y = temp_br_y;
     }
+
+    if (layer->topology_joined)
+      continue;
+    /*
+     * Join the new screen to every screen already in the forest that it
+     * touches. Screens that are added in the same batch are only compared
+     * once, by whichever of the pair is joined second.
+     */
+    topo->parent[i] = i;
+    topo->rank[i] = 0;
+    ++topo->components;
+    layer->topology_joined = true;
+    for (size_t j = 0; j < state->layer_count; ++j) {
+      struct drawable_layer *other = state->layers[j];
+      if (j == i || !other->topology_joined)
+        continue;
+      if (check_screen_touch(*geometry, other->geometry)
+        || check_screen_touch(other->geometry, *geometry)) {
+        topology_union(topo, i, j);
+      }
+    }
   }
 
   if (ul_corner_x > br_corner_x) {
@@ -251,45 +518,12 @@ static void recalc_global_space(struct disp_state * state) {
     return;
   }
 
-  struct output_geometry *conn_screen_list[MAX_DRAWABLE_LAYERS];
-  conn_screen_list[0] = screen_list[0];
-  size_t conn_screen_list_len = 1;
-
   /*
    * Check for gaps between the screens. We don't support running if gaps are
-   * present.
-   *
-   * If a screen's left edge touches another screen, current_screen->x ==
-   * left_screen->x + left_screen->width.
-   * If a screen's right edge touches another screen, current_screen->x +
-   * current_screen->width == right_screen->x
-   * If a screen's top edge touches another screen, current_screen->y ==
-   * up_screen->y + up_screen->height
-   * If a screen's bottom edge touches another screen, current_screen->y +
-   * current_screen->height == bottom_screen->y
+   * present. Every screen that touches or overlaps another shares a set with
+   * it, so a gap shows up as more than one set.
    */
-  for (size_t i = 0; i < conn_screen_list_len; ++i) {
-    for (size_t j = 0; j < screen_list_len; ++j) {
-      bool screen_in_conn_list = false;
-      for (size_t k = 0; k < conn_screen_list_len; ++k) {
-        if (screen_list[j] == conn_screen_list[k]) {
-          screen_in_conn_list = true;
-          break;
-        }
-      }
-      if (screen_in_conn_list)
-        continue;
-      struct output_geometry *conn_screen = conn_screen_list[i];
-      struct output_geometry *cur_screen = screen_list[j];
-      if (check_screen_touch(*conn_screen, *cur_screen)) {
-        /* Found a touching screen! */
-        conn_screen_list[conn_screen_list_len] = cur_screen;
-        ++conn_screen_list_len;
-      }
-    }
-  }
-
-  if (conn_screen_list_len != screen_list_len) {
+  if (topo->components != 1) {
     fprintf(stderr,
       "FATAL ERROR: Multiple screens are attached and gaps are present between them. kloak cannot operate in this configuration.\n");
     exit(1);
@@ -299,35 +533,124 @@ static void recalc_global_space(struct disp_state * state) {
   state->global_space_height = br_corner_y;
   state->pointer_space_x = ul_corner_x;
   state->pointer_space_y = ul_corner_y;
+  trace_record_layout(state);
 }
 
-static struct screen_local_coord abs_coord_to_screen_local_coord(int32_t x,
-  int32_t y) {
-  struct screen_local_coord out_data = { 0 };
+static int compare_output_index_entries(const void *a, const void *b) {
+  const struct output_index_entry *entry_a = a;
+  const struct output_index_entry *entry_b = b;
+  if (entry_a->x != entry_b->x)
+    return entry_a->x < entry_b->x ? -1 : 1;
+  if (entry_a->output_idx != entry_b->output_idx)
+    return entry_a->output_idx < entry_b->output_idx ? -1 : 1;
+  return 0;
+}
 
-  for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-    if (!state.output_geometries[i]) {
-      continue;
-    }
-    if (!(x >= state.output_geometries[i]->x)) {
-      continue;
+static void rebuild_output_index(struct disp_state *state) {
+  struct output_index *index = &state->output_index;
+  index->len = 0;
+  index->last_hit = 0;
+  index->max_width = 0;
+  index->has_overlaps = false;
+
+  if (index->capacity < state->layer_count) {
+    free(index->entries);
+    index->capacity = state->layer_capacity;
+    index->entries = calloc(index->capacity,
+      sizeof(struct output_index_entry));
+    if (index->entries == NULL) {
+      fprintf(stderr,
+        "FATAL ERROR: Could not allocate memory for output index!\n");
+      exit(1);
     }
-    if (!(y >= state.output_geometries[i]->y)) {
+  }
+
+  for (size_t i = 0; i < state->layer_count; ++i) {
+    if (!state->layers[i]->geometry_valid)
       continue;
+    struct output_geometry *geometry = &state->layers[i]->geometry;
+    struct output_index_entry *entry = &index->entries[index->len];
+    entry->x = geometry->x;
+    entry->y = geometry->y;
+    entry->x_end = geometry->x + geometry->width;
+    entry->y_end = geometry->y + geometry->height;
+    entry->output_idx = (int32_t) i;
+    if (geometry->width > index->max_width)
+      index->max_width = geometry->width;
+    ++index->len;
+  }
+
+  qsort(index->entries, index->len, sizeof(struct output_index_entry),
+    compare_output_index_entries);
+
+  for (size_t i = 0; i < index->len && !index->has_overlaps; ++i) {
+    for (size_t j = i + 1; j < index->len; ++j) {
+      struct output_index_entry *a = &index->entries[i];
+      struct output_index_entry *b = &index->entries[j];
+      if (b->x >= a->x_end)
+        break;
+      if (a->y < b->y_end && b->y < a->y_end) {
+        index->has_overlaps = true;
+        break;
+      }
     }
-    if (!(x < state.output_geometries[i]->x
-      + state.output_geometries[i]->width)) {
-      continue;
+  }
+}
+
+static bool output_index_entry_contains(struct output_index_entry *entry,
+  int32_t x, int32_t y) {
+  return x >= entry->x && x < entry->x_end && y >= entry->y
+    && y < entry->y_end;
+}
+
+static struct screen_local_coord abs_coord_to_screen_local_coord(int32_t x,
+  int32_t y) {
+  struct screen_local_coord out_data = { 0 };
+  struct output_index *index = &state.output_index;
+  struct output_index_entry *hit = NULL;
+
+  /*
+   * Consecutive lookups almost always land on the same screen, so try the
+   * last hit first. This is only safe when no screens overlap, since
+   * otherwise a point may be covered by several screens and we must pick the
+   * one with the lowest output index.
+   */
+  if (!index->has_overlaps && index->last_hit < index->len
+    && output_index_entry_contains(&index->entries[index->last_hit], x, y)) {
+    hit = &index->entries[index->last_hit];
+  } else {
+    /* Find the first entry that starts to the right of x. */
+    size_t lo = 0;
+    size_t hi = index->len;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (index->entries[mid].x <= x) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
     }
-    if (!(y < state.output_geometries[i]->y
-      + state.output_geometries[i]->height)) {
-      continue;
+    /* Any screen covering x starts at most max_width pixels left of it. */
+    for (size_t i = lo; i > 0; --i) {
+      struct output_index_entry *entry = &index->entries[i - 1];
+      if ((int64_t) entry->x + index->max_width <= x)
+        break;
+      if (!output_index_entry_contains(entry, x, y))
+        continue;
+      if (!hit || entry->output_idx < hit->output_idx) {
+        hit = entry;
+        index->last_hit = i - 1;
+      }
+      if (!index->has_overlaps)
+        break;
     }
-    out_data.output_idx = i;
-    out_data.x = x - state.output_geometries[i]->x;
-    out_data.y = y - state.output_geometries[i]->y;
+  }
+
+  if (hit) {
+    out_data.output_idx = hit->output_idx;
+    out_data.x = x - hit->x;
+    out_data.y = y - hit->y;
     out_data.valid = true;
-    break;
   }
 
   /* There is a possibility that out_data will contain all zeros; if this
@@ -344,90 +667,226 @@ static struct coord screen_local_coord_to_abs_coord(uint32_t x, uint32_t y,
     .y = -1,
   };
 
-  if (!state.layers[output_idx]
-    || x >= state.output_geometries[output_idx]->width
-    || y >= state.output_geometries[output_idx]->height) {
+  if (output_idx < 0 || (size_t) output_idx >= state.layer_count)
+    return out_val;
+  struct drawable_layer *layer = state.layers[output_idx];
+  if (!layer->geometry_valid || x >= layer->geometry.width
+    || y >= layer->geometry.height) {
     return out_val;
   }
-  out_val.x = state.output_geometries[output_idx]->x + x;
-  out_val.y = state.output_geometries[output_idx]->y + y;
+  out_val.x = layer->geometry.x + x;
+  out_val.y = layer->geometry.y + y;
   return out_val;
 }
 
-struct coord traverse_line(struct coord start, struct coord end,
+static void line_iter_init(struct line_iter *iter, struct coord start,
+  struct coord end) {
+  int32_t dx = end.x - start.x;
+  int32_t dy = end.y - start.y;
+  int32_t abs_dx = dx < 0 ? -dx : dx;
+  int32_t abs_dy = dy < 0 ? -dy : dy;
+
+  iter->start = start;
+  iter->step_x = dx < 0 ? -1 : 1;
+  iter->step_y = dy < 0 ? -1 : 1;
+  /* Lines with a slope of exactly 1 step along Y, like they always have. */
+  iter->x_major = abs_dx > abs_dy;
+  iter->major = iter->x_major ? abs_dx : abs_dy;
+  iter->minor = iter->x_major ? abs_dy : abs_dx;
+  iter->pos = 0;
+  iter->minor_off = 0;
+  iter->err = 0;
+  iter->cur = start;
+}
+
+static struct coord line_iter_point(const struct line_iter *iter,
+  int32_t major_off, int32_t minor_off) {
+  struct coord out_val = iter->start;
+  if (iter->x_major) {
+    out_val.x += iter->step_x * major_off;
+    out_val.y += iter->step_y * minor_off;
+  } else {
+    out_val.x += iter->step_x * minor_off;
+    out_val.y += iter->step_y * major_off;
+  }
+  return out_val;
+}
+
+static void line_iter_next(struct line_iter *iter) {
+  if (iter->major == 0)
+    return;
+  ++iter->pos;
+  /* err is always pos * minor % major, and minor <= major, so the minor
+   * offset moves at most one pixel per step. */
+  iter->err += iter->minor;
+  if (iter->err >= iter->major) {
+    iter->err -= iter->major;
+    ++iter->minor_off;
+  }
+  iter->cur = line_iter_point(iter, iter->pos, iter->minor_off);
+}
+
+static struct coord line_iter_coord_at(const struct line_iter *iter,
   int32_t pos) {
-  if (pos == 0) return start;
-  struct coord out_val = { 0 };
-
-  double num = ((double) end.y) - ((double) start.y);
-  double denom = ((double) start.x) - ((double) end.x);
-  if (denom == 0) {
-    /* vertical line */
-    out_val.x = start.x;
-    if (start.y < end.y) {
-      out_val.y = start.y + pos;
-    } else {
-      out_val.y = start.y - pos;
-    }
-    return out_val;
+  if (iter->major == 0)
+    return iter->start;
+  int32_t minor_off = (int32_t) (((int64_t) pos * iter->minor) / iter->major);
+  return line_iter_point(iter, pos, minor_off);
+}
+
+static void line_iter_seek(struct line_iter *iter, int32_t pos) {
+  if (iter->major == 0)
+    return;
+  int64_t product = (int64_t) pos * iter->minor;
+  iter->pos = pos;
+  iter->minor_off = (int32_t) (product / iter->major);
+  iter->err = (int32_t) (product % iter->major);
+  iter->cur = line_iter_point(iter, iter->pos, iter->minor_off);
+}
+
+static int64_t line_iter_offset_pos(const struct line_iter *iter,
+  bool x_axis, int64_t offset) {
+  if (x_axis == iter->x_major)
+    return offset;
+  if (iter->minor == 0)
+    return INT64_MAX;
+  /* Smallest pos with floor(pos * minor / major) >= offset */
+  return (offset * iter->major + iter->minor - 1) / iter->minor;
+}
+
+static void render_crosshair_sprite(struct cursor_sprite *sprite,
+  int32_t rad, uint32_t color) {
+  sprite->rad = rad;
+  sprite->size = rad * 2 + 1;
+  sprite->pixels = calloc((size_t) sprite->size * (size_t) sprite->size,
+    sizeof(uint32_t));
+  if (sprite->pixels == NULL) {
+    fprintf(stderr,
+      "FATAL ERROR: Could not allocate memory for cursor sprite!\n");
+    exit(1);
+  }
+  for (int32_t i = 0; i < sprite->size; ++i) {
+    /* vertical and horizontal line through the center */
+    sprite->pixels[i * sprite->size + rad] = color;
+    sprite->pixels[rad * sprite->size + i] = color;
   }
+}
 
-  double slope = num / denom;
-  double steep;
-  if (slope < 0)
-    steep = -slope;
-  else
-    steep = slope;
+static bool clip_block(int32_t x, int32_t y, int32_t layer_width,
+  int32_t layer_height, int32_t rad, struct block_clip *clip) {
+  clip->start_x = max(x - rad, 0);
+  clip->start_y = max(y - rad, 0);
+  clip->end_x = min(x + rad, layer_width - 1);
+  clip->end_y = min(y + rad, layer_height - 1);
+  return clip->start_x <= clip->end_x && clip->start_y <= clip->end_y;
+}
 
-  if (steep < 1) {
-    if (start.x < end.x) {
-      out_val.x = start.x + pos;
-    } else {
-      out_val.x = start.x - pos;
-    }
-    if (start.y < end.y) {
-      out_val.y = start.y + (int32_t)((double) pos * steep);
-    } else {
-      out_val.y = start.y - (int32_t)((double) pos * steep);
-    }
-  } else {
-    if (start.y < end.y) {
-      out_val.y = start.y + pos;
-    } else {
-      out_val.y = start.y - pos;
-    }
-    if (start.x < end.x) {
-      out_val.x = start.x + (int32_t)((double) pos * (1 / steep));
-    } else {
-      out_val.x = start.x - (int32_t)((double) pos * (1 / steep));
-    }
+static void clear_block(uint32_t *pixbuf, int32_t x, int32_t y,
+  int32_t layer_width, int32_t layer_height, int32_t rad) {
+  struct block_clip clip;
+  if (!clip_block(x, y, layer_width, layer_height, rad, &clip))
+    return;
+
+  /* Transparent is all-zero, so each row is a plain memset, which libc
+   * already vectorizes. */
+  size_t row_bytes = (size_t) (clip.end_x - clip.start_x + 1)
+    * sizeof(uint32_t);
+  for (int32_t work_y = clip.start_y; work_y <= clip.end_y; ++work_y) {
+    memset(&pixbuf[(size_t) work_y * layer_width + clip.start_x], 0,
+      row_bytes);
   }
+}
 
-  return out_val;
+static void blit_sprite(uint32_t *pixbuf, int32_t x, int32_t y,
+  int32_t layer_width, int32_t layer_height,
+  const struct cursor_sprite *sprite) {
+  struct block_clip clip;
+  if (!clip_block(x, y, layer_width, layer_height, sprite->rad, &clip))
+    return;
+
+  /* Sprite coordinates of the upper-left corner of the clipped area */
+  int32_t sprite_x = clip.start_x - (x - sprite->rad);
+  int32_t sprite_y = clip.start_y - (y - sprite->rad);
+  size_t row_bytes = (size_t) (clip.end_x - clip.start_x + 1)
+    * sizeof(uint32_t);
+  for (int32_t work_y = clip.start_y; work_y <= clip.end_y;
+    ++work_y, ++sprite_y) {
+    memcpy(&pixbuf[(size_t) work_y * layer_width + clip.start_x],
+      &sprite->pixels[sprite_y * sprite->size + sprite_x], row_bytes);
+  }
 }
 
-static void draw_block(uint32_t *pixbuf, int32_t x, int32_t y,
-  int32_t layer_width, int32_t layer_height, int32_t rad, bool crosshair) {
-  int32_t start_x = x - rad;
-  if (start_x < 0) start_x = 0;
-  int32_t start_y = y - rad;
-  if (start_y < 0) start_y = 0;
-  int32_t end_x = x + rad;
-  if (end_x >= layer_width) end_x = layer_width - 1;
-  int32_t end_y = y + rad;
-  if (end_y >= layer_height) end_y = layer_height - 1;
-
-  for (int32_t work_y = start_y; work_y <= end_y; ++work_y) {
-    for (int32_t work_x = start_x; work_x <= end_x; ++work_x) {
-      if (crosshair && work_x == x) {
-        pixbuf[work_y * layer_width + work_x] = 0xffff0000;
-      } else if (crosshair && work_y == y) {
-        pixbuf[work_y * layer_width + work_x] = 0xffff0000;
-      } else {
-        pixbuf[work_y * layer_width + work_x] = 0x00000000;
-      }
+#define ROTL64(v, n) (((v) << (n)) | ((v) >> (64 - (n))))
+
+static uint64_t hash_bytes(const void *data, size_t len) {
+  /* The single-lane xxh64 round and avalanche; the constants are xxh64's. */
+  const uint64_t p1 = 0x9e3779b185ebca87ULL;
+  const uint64_t p2 = 0xc2b2ae3d27d4eb4fULL;
+  const uint64_t p3 = 0x165667b19e3779f9ULL;
+  const uint64_t p4 = 0x85ebca77c2b2ae63ULL;
+  const uint64_t p5 = 0x27d4eb2f165667c5ULL;
+  const uint8_t *bytes = data;
+  uint64_t h = p5 + (uint64_t) len;
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    word *= p2;
+    word = ROTL64(word, 31) * p1;
+    h ^= word;
+    h = ROTL64(h, 27) * p1 + p4;
+  }
+  for (; i < len; ++i) {
+    h ^= bytes[i] * p5;
+    h = ROTL64(h, 11) * p1;
+  }
+  h ^= h >> 33;
+  h *= p2;
+  h ^= h >> 29;
+  h *= p3;
+  h ^= h >> 32;
+  return h;
+}
+
+static struct keymap_cache_entry *keymap_cache_lookup(
+  struct keymap_cache *cache, uint64_t hash, const char *text,
+  uint32_t size) {
+  for (size_t i = 0; i < KEYMAP_CACHE_SIZE; ++i) {
+    struct keymap_cache_entry *entry = &cache->entries[i];
+    /* The hash only picks the candidate, the bytes decide. */
+    if (entry->keymap && entry->hash == hash && entry->size == size
+      && memcmp(entry->text, text, size) == 0) {
+      entry->last_used = ++cache->clock;
+      return entry;
     }
   }
+  return NULL;
+}
+
+static struct keymap_cache_entry *keymap_cache_insert(
+  struct keymap_cache *cache, uint64_t hash, char *text, uint32_t size,
+  struct xkb_keymap *keymap) {
+  struct keymap_cache_entry *victim = &cache->entries[0];
+  for (size_t i = 0; i < KEYMAP_CACHE_SIZE; ++i) {
+    struct keymap_cache_entry *entry = &cache->entries[i];
+    if (!entry->keymap) {
+      victim = entry;
+      break;
+    }
+    if (entry->last_used < victim->last_used)
+      victim = entry;
+  }
+  if (victim->keymap) {
+    xkb_keymap_unref(victim->keymap);
+    munmap(victim->text, victim->size);
+  }
+  victim->hash = hash;
+  victim->text = text;
+  victim->size = size;
+  victim->keymap = keymap;
+  victim->last_used = ++cache->clock;
+  return victim;
 }
 
 static int32_t parse_uintarg(const char *arg_name, const char *val) {
@@ -450,209 +909,853 @@ parse_uintarg_error:
   return -1;
 }
 
-static void sleep_ms(long ms) {
-  struct timespec ts;
-  ts.tv_sec = ms / 1000;
-  ts.tv_nsec = (ms % 1000) * 1000000;
-  int nanosleep_ret;
-  do {
-    nanosleep_ret = nanosleep(&ts, &ts);
-  } while (nanosleep_ret == -1 && errno == EINTR);
-
-  if (nanosleep_ret == -1) {
-    fprintf(stderr,
-      "FATAL ERROR: Could not sleep for requested start duration!\n");
-    exit(1);
-  }
-}
-
-/********************/
-/* wayland handling */
-/********************/
-
-static void registry_handle_global(void *data, struct wl_registry *registry,
-  uint32_t name, const char *interface, uint32_t version) {
-  struct disp_state *state = data;
-  if (strcmp(interface, wl_compositor_interface.name) == 0) {
-    state->compositor = wl_registry_bind(registry, name,
-      &wl_compositor_interface, 5);
-  } else if (strcmp(interface, wl_seat_interface.name) == 0) {
-    if (!state->seat_set) {
-      state->seat = wl_registry_bind(registry, name, &wl_seat_interface, 9);
-      state->seat_set = true;
-    } else {
-      fprintf(stderr,
-        "WARNING: Multiple seats detected, all but first will be ignored.\n");
-    }
-  } else if (strcmp(interface, wl_shm_interface.name) == 0) {
-    state->shm = wl_registry_bind(registry, name, &wl_shm_interface, 2);
-  } else if (strcmp(interface, wl_output_interface.name) == 0) {
-    bool new_layer_allocated = false;
-    for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-      if (!state->layers[i]) {
-        state->outputs[i] = wl_registry_bind(registry, name,
-          &wl_output_interface, 4);
-        state->output_names[i] = name;
-        state->layers[i] = allocate_drawable_layer(state, state->outputs[i]);
-        if (state->xdg_output_manager) {
-          /*
-           * We can only create xdg_outputs for wl_outputs if we've received
-           * the zxdg_output_manager_v1 object from the server, thus the 'if'
-           * condition here. When we *do* get the zxdg_output_manager_v1
-           * object, we go through and make xdg_outputs for any wl_outputs
-           * that were sent too early.
-           *
-           * NOTE: We do not add wl_output listeners until we have the
-           * zxdg_output_manager_v1 object to avoid the situation where we get
-           * wl_output_done signals before an xdg_output is created for a
-           * wl_output.
-           */
-          state->xdg_outputs[i] = zxdg_output_manager_v1_get_xdg_output(
-            state->xdg_output_manager, state->outputs[i]);
-          zxdg_output_v1_add_listener(state->xdg_outputs[i],
-            &xdg_output_listener, state);
-          wl_output_add_listener(state->outputs[i], &output_listener, state);
-          state->pending_output_geometries[i] = calloc(1,
-            sizeof(struct output_geometry));
-        }
-        new_layer_allocated = true;
-        break;
-      }
-    }
-    if (!new_layer_allocated) {
+static void parse_cpu_list(const char *val, cpu_set_t *cpus) {
+  const char *pos = val;
+  CPU_ZERO(cpus);
+  for (;;) {
+    char *end;
+    unsigned long cpu = strtoul(pos, &end, 10);
+    if (end == pos || cpu >= CPU_SETSIZE || (*end != ',' && *end != '\0')) {
       fprintf(stderr,
-        "FATAL ERROR: Cannot handle more than %d displays attached at once!\n",
-        MAX_DRAWABLE_LAYERS);
+        "FATAL ERROR: Invalid value '%s' passed to parameter 'cpu-affinity'!\n",
+        val);
       exit(1);
     }
-  } else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0) {
-    state->xdg_output_manager = wl_registry_bind(registry, name,
-      &zxdg_output_manager_v1_interface, 3);
-    for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-      if (state->outputs[i]) {
-        if (!state->xdg_outputs[i]) {
-          /* This is where we make xdg_outputs for any wl_outputs that were
-           * sent too early. */
-          state->xdg_outputs[i] = zxdg_output_manager_v1_get_xdg_output(
-            state->xdg_output_manager, state->outputs[i]);
-          zxdg_output_v1_add_listener(state->xdg_outputs[i],
-            &xdg_output_listener, state);
-          wl_output_add_listener(state->outputs[i], &output_listener, state);
-          state->pending_output_geometries[i] = calloc(1,
-            sizeof(struct output_geometry));
-        }
-      }
-    }
-  } else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
-    state->layer_shell = wl_registry_bind(registry, name,
-      &zwlr_layer_shell_v1_interface, 4);
-  } else if (
-    strcmp(interface, zwlr_virtual_pointer_manager_v1_interface.name) == 0) {
-    state->virt_pointer_manager = wl_registry_bind(registry, name,
-      &zwlr_virtual_pointer_manager_v1_interface, 2);
-    state->virt_pointer
-      = zwlr_virtual_pointer_manager_v1_create_virtual_pointer(
-      state->virt_pointer_manager, NULL);
-  } else if (
-    strcmp(interface, zwp_virtual_keyboard_manager_v1_interface.name) == 0) {
-    state->virt_kb_manager = wl_registry_bind(registry, name,
-      &zwp_virtual_keyboard_manager_v1_interface, 1);
+    CPU_SET(cpu, cpus);
+    if (*end == '\0')
+      break;
+    pos = end + 1;
   }
 }
 
-static void registry_handle_global_remove(void *data,
-  struct wl_registry *registry, uint32_t name) {
-  struct disp_state *state = data;
-  for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-    if (state->layers[i]) {
-      if (state->output_names[i] == name) {
-        struct drawable_layer *layer = state->layers[i];
-        zwlr_layer_surface_v1_destroy(layer->layer_surface);
-        wl_output_release(state->outputs[i]);
-        state->outputs[i] = NULL;
-        state->output_names[i] = 0;
-        zxdg_output_v1_destroy(state->xdg_outputs[i]);
-        state->xdg_outputs[i] = NULL;
-        free(state->pending_output_geometries[i]);
-        state->pending_output_geometries[i] = NULL;
-        state->output_geometries[i] = NULL;
-        wl_surface_destroy(layer->surface);
-        if (layer->pixbuf != NULL) {
-          munmap(layer->pixbuf, layer->size);
-        }
-        if (layer->shm_pool != NULL) {
-          wl_shm_pool_destroy(layer->shm_pool);
-        }
-        free(layer);
-        state->layers[i] = NULL;
-        recalc_global_space(state);
-        break;
-      }
+static void add_seat(const char *name) {
+  for (size_t i = 0; i < seat_count; ++i) {
+    if (strcmp(seats[i].name, name) == 0) {
+      fprintf(stderr, "FATAL ERROR: Seat '%s' was given more than once!\n",
+        name);
+      exit(1);
     }
   }
+  if (seat_count == MAX_SEATS) {
+    fprintf(stderr, "FATAL ERROR: At most %d seats are supported!\n",
+      MAX_SEATS);
+    exit(1);
+  }
+  struct seat_context *seat = &seats[seat_count];
+  seat->idx = seat_count;
+  seat->name = name;
+  seat->capture_event_fd = -1;
+  ++seat_count;
 }
 
-static void seat_handle_name(void *data, struct wl_seat *seat,
-  const char *name) {
-  struct disp_state *state = data;
-  state->seat_name = name;
+static size_t prefault_memory(void *addr, size_t len) {
+  volatile uint8_t *bytes = addr;
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (addr == NULL || len == 0)
+    return 0;
+  /* Writing a byte back is enough to fault the page in for writing. */
+  for (size_t off = 0; off < len; off += (size_t) page_size)
+    bytes[off] = bytes[off];
+  bytes[len - 1] = bytes[len - 1];
+  return len;
 }
 
-static void seat_handle_capabilities(void *data, struct wl_seat *seat,
-  uint32_t capabilities) {
-  struct disp_state *state = data;
-  state->seat_caps = capabilities;
-  if (capabilities | WL_SEAT_CAPABILITY_KEYBOARD) {
-    state->kb = wl_seat_get_keyboard(seat);
-    wl_keyboard_add_listener(state->kb, &kb_listener, state);
-  } else {
+static void prefault_stack(void) {
+  uint8_t stack[REALTIME_STACK_PREFAULT_BYTES];
+  memset(stack, 0, sizeof(stack));
+  /* Keep the compiler from dropping the memset. */
+  __asm__ __volatile__("" : : "r"(stack) : "memory");
+}
+
+static int ms_until(int64_t deadline) {
+  int64_t remaining = deadline - current_time_us();
+  if (remaining <= 0)
+    return 0;
+  /* Round up, so that a poll() timeout never ends before the deadline. */
+  return (int) min((remaining + 999) / 1000, INT32_MAX);
+}
+
+static void packet_ring_init(struct packet_ring *ring, size_t capacity) {
+  ring->packets = calloc(capacity, sizeof(struct input_packet));
+  if (ring->packets == NULL) {
     fprintf(stderr,
-      "FATAL ERROR: No keyboard capability for seat, cannot continue.\n");
+      "FATAL ERROR: Could not allocate memory for input packet queue!\n");
     exit(1);
   }
+  ring->capacity = capacity;
+  ring->first = 0;
+  ring->len = 0;
 }
 
-static void kb_handle_keymap(void *data, struct wl_keyboard *kb,
-  uint32_t format, int32_t fd, uint32_t size) {
-  struct disp_state *state = data;
-  char *kb_map_shm = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (kb_map_shm == MAP_FAILED) {
-    fprintf(stderr, "FATAL ERROR: Could not mmap xkb layout!\n");
+static void packet_ring_grow(struct packet_ring *ring) {
+  size_t new_capacity = ring->capacity * 2;
+  struct input_packet *new_packets = calloc(new_capacity,
+    sizeof(struct input_packet));
+  if (new_packets == NULL) {
+    fprintf(stderr,
+      "FATAL ERROR: Could not allocate memory for input packet queue!\n");
     exit(1);
   }
-  if (state->old_kb_map_shm) {
-    if (strcmp(state->old_kb_map_shm, kb_map_shm) == 0) {
-      /* New and old maps are the same, cleanup and return. */
-      munmap(kb_map_shm, size);
-      close(fd);
-      return;
+  /* Unwrap the ring into the start of the new array. */
+  size_t first_part = min(ring->len, ring->capacity - ring->first);
+  memcpy(new_packets, ring->packets + ring->first,
+    first_part * sizeof(struct input_packet));
+  memcpy(new_packets + first_part, ring->packets,
+    (ring->len - first_part) * sizeof(struct input_packet));
+  free(ring->packets);
+  ring->packets = new_packets;
+  ring->capacity = new_capacity;
+  ring->first = 0;
+  ++ring->grow_count;
+}
+
+static struct input_packet *packet_ring_first(struct packet_ring *ring) {
+  if (ring->len == 0)
+    return NULL;
+  return &ring->packets[ring->first];
+}
+
+static struct input_packet *packet_ring_last(struct packet_ring *ring) {
+  if (ring->len == 0)
+    return NULL;
+  return &ring->packets[(ring->first + ring->len - 1)
+    & (ring->capacity - 1)];
+}
+
+static struct input_packet *packet_ring_push(struct packet_ring *ring) {
+  if (ring->len == ring->capacity) {
+    packet_ring_grow(ring);
+  }
+  struct input_packet *packet = &ring->packets[(ring->first + ring->len)
+    & (ring->capacity - 1)];
+  memset(packet, 0, sizeof(struct input_packet));
+  ++ring->len;
+  if (ring->len > ring->high_water)
+    ring->high_water = ring->len;
+  return packet;
+}
+
+static void packet_ring_pop(struct packet_ring *ring) {
+  if (ring->len == 0)
+    return;
+  ring->first = (ring->first + 1) & (ring->capacity - 1);
+  --ring->len;
+}
+
+static void capture_ring_init(struct capture_ring *ring, size_t capacity) {
+  ring->entries = calloc(capacity, sizeof(struct capture_entry));
+  if (ring->entries == NULL) {
+    fprintf(stderr,
+      "FATAL ERROR: Could not allocate memory for capture ring!\n");
+    exit(1);
+  }
+  ring->capacity = capacity;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->full_waits, 0);
+}
+
+static bool capture_ring_push(struct capture_ring *ring,
+  const struct capture_entry *entry) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head == ring->capacity)
+    return false;
+  ring->entries[tail & (ring->capacity - 1)] = *entry;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+static bool capture_ring_pop(struct capture_ring *ring,
+  struct capture_entry *entry) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head == tail)
+    return false;
+  if (tail - head > ring->high_water)
+    ring->high_water = tail - head;
+  *entry = ring->entries[head & (ring->capacity - 1)];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+static bool capture_ring_empty(struct capture_ring *ring) {
+  return atomic_load_explicit(&ring->head, memory_order_relaxed)
+    == atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+static void add_epoll_fd(int fd, uint32_t src) {
+  struct epoll_event ev = {
+    .events = EPOLLIN,
+    .data.u32 = src,
+  };
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    fprintf(stderr, "FATAL ERROR: Could not add fd to epoll set: %s\n",
+      strerror(errno));
+    exit(1);
+  }
+}
+
+static size_t histogram_bucket_index(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return (size_t) value;
+  unsigned int msb = 63 - (unsigned int) __builtin_clzll(value);
+  unsigned int shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+  size_t idx = (size_t) (shift + 1) * HISTOGRAM_SUB_BUCKETS
+    + (size_t) ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+  return min(idx, HISTOGRAM_BUCKETS - 1);
+}
+
+static uint64_t histogram_bucket_value(size_t idx) {
+  if (idx < HISTOGRAM_SUB_BUCKETS)
+    return idx;
+  unsigned int shift = (unsigned int) (idx / HISTOGRAM_SUB_BUCKETS) - 1;
+  uint64_t sub = idx % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+  /* Report the highest value that maps to this bucket. */
+  return ((sub + 1) << shift) - 1;
+}
+
+static void histogram_record(struct histogram *hist, int64_t value) {
+  uint64_t v = value < 0 ? 0 : (uint64_t) value;
+  ++hist->counts[histogram_bucket_index(v)];
+  if (hist->count == 0 || v < hist->min)
+    hist->min = v;
+  if (v > hist->max)
+    hist->max = v;
+  hist->sum += v;
+  ++hist->count;
+}
+
+static uint64_t histogram_percentile(const struct histogram *hist,
+  uint32_t permille) {
+  if (hist->count == 0)
+    return 0;
+  uint64_t target = (hist->count * permille + 999) / 1000;
+  if (target == 0)
+    target = 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    seen += hist->counts[i];
+    if (seen >= target)
+      return min(histogram_bucket_value(i), hist->max);
+  }
+  return hist->max;
+}
+
+static void dump_histogram(const char *name, const struct histogram *hist) {
+  fprintf(stderr,
+    "kloak histogram: name=%s count=%" PRIu64 " min=%" PRIu64
+    " mean=%" PRIu64 " p50=%" PRIu64 " p90=%" PRIu64 " p99=%" PRIu64
+    " p999=%" PRIu64 " max=%" PRIu64 "\n",
+    name, hist->count, hist->count ? hist->min : 0,
+    hist->count ? hist->sum / hist->count : 0,
+    histogram_percentile(hist, 500), histogram_percentile(hist, 900),
+    histogram_percentile(hist, 990), histogram_percentile(hist, 999),
+    hist->max);
+}
+
+static void arm_release_timer(void) {
+  /* One timer serves every seat, so it fires for the earliest of them. */
+  int64_t deadline = -1;
+  for (size_t i = 0; i < seat_count; ++i) {
+    struct input_packet *packet = packet_ring_first(&seats[i].packet_queue);
+    if (packet && (deadline < 0 || packet->sched_time < deadline))
+      deadline = packet->sched_time;
+  }
+  if (deadline == armed_release_deadline)
+    return;
+
+  /* An all-zero it_value disarms the timer, which is what we want when the
+   * queue is empty. */
+  struct itimerspec spec = { 0 };
+  if (deadline >= 0) {
+    spec.it_value.tv_sec = deadline / 1000000;
+    spec.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+      spec.it_value.tv_nsec = 1;
+  }
+  if (timerfd_settime(release_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    fprintf(stderr, "FATAL ERROR: Could not arm release timer: %s\n",
+      strerror(errno));
+    exit(1);
+  }
+  armed_release_deadline = deadline;
+}
+
+static void dump_stats(void) {
+  size_t shm_bytes = 0;
+  for (size_t i = 0; i < state.layer_count; ++i) {
+    shm_bytes += state.layers[i]->pool_size;
+  }
+  /* Queue figures are totals over all seats, the high water mark is the
+   * deepest any one queue got. */
+  struct packet_ring queues = { 0 };
+  for (size_t i = 0; i < seat_count; ++i) {
+    struct packet_ring *queue = &seats[i].packet_queue;
+    queues.len += queue->len;
+    queues.capacity += queue->capacity;
+    queues.high_water = max(queues.high_water, queue->high_water);
+    queues.grow_count += queue->grow_count;
+  }
+  fprintf(stderr,
+    "kloak stats: loop_wakeups=%" PRIu64 " timer_wakeups=%" PRIu64
+    " queue_len=%zu queue_capacity=%zu queue_high_water=%zu"
+    " queue_grow_count=%" PRIu64 " shm_bytes=%zu"
+    " pointer_frames_sent=%" PRIu64 " modifier_updates_sent=%" PRIu64
+    " modifier_updates_skipped=%" PRIu64
+    " packets_released=%" PRIu64 " motion_coalesced=%" PRIu64
+    " motion_suppressed=%" PRIu64 " scroll_coalesced=%" PRIu64
+    " keymap_cache_hits=%" PRIu64 " keymap_cache_misses=%" PRIu64
+    " input_budget_hits=%" PRIu64 "\n",
+    loop_wakeups, timer_wakeups, queues.len, queues.capacity,
+    queues.high_water, queues.grow_count, shm_bytes,
+    pointer_frames_sent, modifier_updates_sent, modifier_updates_skipped,
+    metrics.packets_released, metrics.motion_coalesced,
+    metrics.motion_suppressed, metrics.scroll_coalesced,
+    metrics.keymap_cache_hits, metrics.keymap_cache_misses,
+    metrics.input_budget_hits);
+  for (size_t i = 0; i < seat_count; ++i) {
+    struct seat_context *seat = &seats[i];
+    struct adaptive_delay *ad = &seat->adaptive_delay;
+    fprintf(stderr,
+      "kloak seat %zu: name=%s wl_seat=%s queue_len=%zu"
+      " queue_high_water=%zu keymap=%d\n",
+      i, seat->name,
+      seat->binding && seat->binding->name ? seat->binding->name : "-",
+      seat->packet_queue.len, seat->packet_queue.high_water,
+      seat->xkb_state != NULL);
+    if (ad->enabled) {
+      fprintf(stderr,
+        "kloak delay: seat=%s mode=adaptive floor_us=%" PRId64
+        " ceiling_us=%" PRId64 " window_us=%" PRId64 " gap_ewma_us=%" PRId64
+        " shrunk_events=%" PRIu64 "\n",
+        seat->name, ad->floor_us, (int64_t) max_delay * 1000,
+        ad->window_us, ad->gap_ewma_us, ad->shrunk_events);
     } else {
-      munmap(state->old_kb_map_shm, state->old_kb_map_shm_size);
+      fprintf(stderr,
+        "kloak delay: seat=%s mode=fixed window_us=%" PRId64 "\n",
+        seat->name, (int64_t) max_delay * 1000);
+    }
+    if (threaded_capture) {
+      fprintf(stderr,
+        "kloak capture: seat=%s ring_capacity=%zu ring_high_water=%zu"
+        " full_waits=%" PRIu64 "\n",
+        seat->name, seat->capture_ring.capacity,
+        seat->capture_ring.high_water,
+        atomic_load_explicit(&seat->capture_ring.full_waits,
+          memory_order_relaxed));
     }
   }
-  zwp_virtual_keyboard_v1_keymap(state->virt_kb, format, fd, size);
-  state->old_kb_map_shm = kb_map_shm;
-  state->old_kb_map_shm_size = size;
-  if (state->xkb_keymap) {
-    xkb_keymap_unref(state->xkb_keymap);
+  for (size_t i = 0; i < state.layer_count; ++i) {
+    struct drawable_layer *layer = state.layers[i];
+    fprintf(stderr,
+      "kloak layer %zu: refresh_mhz=%d frames_committed=%" PRIu64
+      " frames_presented=%" PRIu64 " frames_skipped=%" PRIu64
+      " updates_coalesced=%" PRIu64
+      " damaged_pixels=%" PRIu64 " last_frame_damaged_pixels=%" PRId64
+      "\n",
+      i, layer->refresh_mhz, layer->frames_committed,
+      layer->frames_presented, layer->frames_skipped,
+      layer->updates_coalesced,
+      layer->damaged_pixels, layer->last_frame_damaged_pixels);
+  }
+  dump_histogram("input_to_release_us", &metrics.input_to_release_us);
+  dump_histogram("release_lateness_us", &metrics.release_lateness_us);
+  dump_histogram("queue_depth", &metrics.queue_depth);
+  dump_histogram("update_cursor_ns", &metrics.update_cursor_ns);
+  fprintf(stderr,
+    "kloak startup: socket_us=%" PRId64 " globals_us=%" PRId64
+    " keymap_us=%" PRId64 " ready_us=%" PRId64 " timed_out=%d\n",
+    startup_elapsed_us(startup.socket_ready),
+    startup_elapsed_us(startup.globals_ready),
+    startup_elapsed_us(startup.keymap_ready),
+    startup_elapsed_us(startup.ready), startup.timed_out);
+  fprintf(stderr,
+    "kloak probe: records=%" PRIu64 " ring_size=%d log=%d\n",
+    probe_log.count, PROBE_RING_SIZE, probe_log.file != NULL);
+  if (realtime.enabled) {
+    const char *policy_name = "other";
+    if (realtime.achieved_policy == SCHED_FIFO) {
+      policy_name = "fifo";
+    } else if (realtime.achieved_policy == SCHED_RR) {
+      policy_name = "rr";
+    }
+    fprintf(stderr,
+      "kloak realtime: policy=%s priority=%d memory_locked=%d"
+      " affinity_set=%d prefaulted_bytes=%zu\n",
+      policy_name, realtime.achieved_priority, realtime.memory_locked,
+      realtime.affinity_set, realtime.prefaulted_bytes);
+  }
+  dump_backend_stats();
+}
+
+static int64_t startup_elapsed_us(int64_t when) {
+  return when ? when - startup.start : -1;
+}
+
+static void dump_backend_stats(void) {
+  if (backend != &counting_backend) {
+    fprintf(stderr, "kloak backend: name=%s\n", backend->name);
+    return;
+  }
+  fprintf(stderr,
+    "kloak backend: name=%s motion=%" PRIu64 " button=%" PRIu64
+    " axis=%" PRIu64 " axis_source=%" PRIu64 " frame=%" PRIu64
+    " modifiers=%" PRIu64 " key=%" PRIu64 " flush=%" PRIu64
+    " draw=%" PRIu64 " bytes=%" PRIu64 "\n",
+    backend->name, backend_counters.motion, backend_counters.button,
+    backend_counters.axis, backend_counters.axis_source,
+    backend_counters.frame, backend_counters.modifiers,
+    backend_counters.key, backend_counters.flush, backend_counters.draw,
+    backend_counters.bytes);
+}
+
+static int32_t trace_fixed(double value, double one) {
+  double scaled = round(value * one);
+  if (scaled > INT32_MAX)
+    return INT32_MAX;
+  if (scaled < INT32_MIN)
+    return INT32_MIN;
+  return (int32_t) scaled;
+}
+
+static void trace_encode_record(const struct trace_record *rec,
+  uint8_t *buf) {
+  buf[0] = (uint8_t) rec->type;
+  buf[1] = rec->arg;
+  buf[2] = 0;
+  buf[3] = 0;
+  store_le32(buf + 4, rec->time_delta_us);
+  store_le32(buf + 8, (uint32_t) rec->a);
+  store_le32(buf + 12, (uint32_t) rec->b);
+  store_le32(buf + 16, (uint32_t) rec->c);
+  store_le32(buf + 20, (uint32_t) rec->d);
+}
+
+static void trace_decode_record(const uint8_t *buf,
+  struct trace_record *rec) {
+  rec->type = (enum trace_record_type) buf[0];
+  rec->arg = buf[1];
+  rec->time_delta_us = load_le32(buf + 4);
+  rec->a = (int32_t) load_le32(buf + 8);
+  rec->b = (int32_t) load_le32(buf + 12);
+  rec->c = (int32_t) load_le32(buf + 16);
+  rec->d = (int32_t) load_le32(buf + 20);
+}
+
+static bool trace_record_to_input_event(const struct trace_record *rec,
+  int64_t time_us, struct decoded_event *ev) {
+  memset(ev, 0, sizeof(*ev));
+  ev->time_us = time_us;
+  switch (rec->type) {
+    case TRACE_RECORD_MOTION:
+      ev->type = INPUT_EVENT_MOTION;
+      ev->dx = rec->a / TRACE_FIXED_ONE;
+      ev->dy = rec->b / TRACE_FIXED_ONE;
+      return true;
+    case TRACE_RECORD_MOTION_ABSOLUTE:
+      ev->type = INPUT_EVENT_MOTION_ABSOLUTE;
+      ev->dx = rec->a / TRACE_ABS_ONE;
+      ev->dy = rec->b / TRACE_ABS_ONE;
+      return true;
+    case TRACE_RECORD_BUTTON:
+    case TRACE_RECORD_KEY:
+      ev->type = rec->type == TRACE_RECORD_BUTTON ? INPUT_EVENT_BUTTON
+        : INPUT_EVENT_KEY;
+      ev->code = (uint32_t) rec->a;
+      ev->pressed = rec->arg & 1;
+      return true;
+    case TRACE_RECORD_SCROLL:
+      ev->type = INPUT_EVENT_SCROLL;
+      ev->scroll_source = (enum scroll_source) (rec->arg & 3);
+      ev->has_vert = (rec->arg >> 2) & 1;
+      ev->has_horiz = (rec->arg >> 3) & 1;
+      ev->vert = rec->a / TRACE_FIXED_ONE;
+      ev->horiz = rec->b / TRACE_FIXED_ONE;
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void trace_open_writer(const char *path) {
+  uint8_t header[TRACE_HEADER_SIZE];
+  /* The trace is effectively a keylog, keep it private to root. */
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd >= 0)
+    trace_writer.file = fdopen(fd, "wb");
+  if (trace_writer.file == NULL) {
+    fprintf(stderr, "FATAL ERROR: Could not create trace file '%s': %s\n",
+      path, strerror(errno));
+    exit(1);
+  }
+  memcpy(header, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+  store_le32(header + TRACE_MAGIC_SIZE, TRACE_VERSION);
+  fwrite(header, 1, sizeof(header), trace_writer.file);
+  trace_writer.last_time_us = current_time_us();
+  trace_writer.dirty = true;
+}
+
+static void trace_write_record(struct trace_record *rec, int64_t time_us) {
+  uint8_t buf[TRACE_RECORD_SIZE];
+  if (trace_writer.file == NULL)
+    return;
+  /* Events from different devices can arrive slightly out of order. */
+  int64_t delta = max(time_us - trace_writer.last_time_us, 0);
+  trace_writer.last_time_us += delta;
+  while (delta > UINT32_MAX) {
+    struct trace_record idle = {
+      .type = TRACE_RECORD_IDLE,
+      .time_delta_us = UINT32_MAX,
+    };
+    trace_encode_record(&idle, buf);
+    fwrite(buf, 1, sizeof(buf), trace_writer.file);
+    delta -= UINT32_MAX;
+  }
+  rec->time_delta_us = (uint32_t) delta;
+  trace_encode_record(rec, buf);
+  fwrite(buf, 1, sizeof(buf), trace_writer.file);
+  trace_writer.dirty = true;
+}
+
+static void trace_record_input_event(const struct decoded_event *ev) {
+  struct trace_record rec = { 0 };
+  if (trace_writer.file == NULL)
+    return;
+  switch (ev->type) {
+    case INPUT_EVENT_MOTION:
+      rec.type = TRACE_RECORD_MOTION;
+      rec.a = trace_fixed(ev->dx, TRACE_FIXED_ONE);
+      rec.b = trace_fixed(ev->dy, TRACE_FIXED_ONE);
+      break;
+    case INPUT_EVENT_MOTION_ABSOLUTE:
+      rec.type = TRACE_RECORD_MOTION_ABSOLUTE;
+      rec.a = trace_fixed(ev->dx, TRACE_ABS_ONE);
+      rec.b = trace_fixed(ev->dy, TRACE_ABS_ONE);
+      break;
+    case INPUT_EVENT_BUTTON:
+    case INPUT_EVENT_KEY:
+      rec.type = ev->type == INPUT_EVENT_BUTTON ? TRACE_RECORD_BUTTON
+        : TRACE_RECORD_KEY;
+      rec.a = (int32_t) ev->code;
+      rec.arg = ev->pressed ? 1 : 0;
+      break;
+    case INPUT_EVENT_SCROLL:
+      rec.type = TRACE_RECORD_SCROLL;
+      rec.arg = (uint8_t) ((ev->scroll_source & 3)
+        | (ev->has_vert ? 4 : 0) | (ev->has_horiz ? 8 : 0));
+      rec.a = trace_fixed(ev->vert, TRACE_FIXED_ONE);
+      rec.b = trace_fixed(ev->horiz, TRACE_FIXED_ONE);
+      break;
   }
-  state->xkb_keymap = xkb_keymap_new_from_string(
-    state->xkb_ctx, kb_map_shm, XKB_KEYMAP_FORMAT_TEXT_V1,
-    XKB_KEYMAP_COMPILE_NO_FLAGS);
-  if (!state->xkb_keymap) {
-    fprintf(stderr, "FATAL ERROR: Could not compile xkb layout!\n");
+  trace_write_record(&rec, ev->time_us > 0 ? ev->time_us
+    : current_time_us());
+}
+
+static void trace_record_layout(struct disp_state *state) {
+  if (trace_writer.file == NULL)
+    return;
+  int64_t now = current_time_us();
+  bool first = true;
+  for (size_t i = 0; i < state->layer_count; ++i) {
+    struct drawable_layer *layer = state->layers[i];
+    if (!layer->geometry_valid)
+      continue;
+    struct trace_record rec = {
+      .type = TRACE_RECORD_OUTPUT,
+      .arg = first ? 1 : 0,
+      .a = layer->geometry.x,
+      .b = layer->geometry.y,
+      .c = layer->geometry.width,
+      .d = layer->geometry.height,
+    };
+    trace_write_record(&rec, now);
+    first = false;
+  }
+}
+
+static void probe_record(enum probe_point point, size_t index, uint32_t kind,
+  uint32_t id, int64_t value, int64_t time_us) {
+  struct probe_record *rec
+    = &probe_log.ring[probe_log.count++ & (PROBE_RING_SIZE - 1)];
+  rec->time_us = time_us;
+  rec->id = id;
+  rec->value = (int32_t) min(max(value, INT32_MIN), INT32_MAX);
+  rec->point = (uint8_t) point;
+  rec->index = (uint8_t) index;
+  rec->kind = (uint8_t) kind;
+#ifdef KLOAK_USDT
+  DTRACE_PROBE6(kloak, probe, rec->point, rec->index, rec->kind, rec->id,
+    rec->value, rec->time_us);
+#endif
+  if (probe_log.file == NULL)
+    return;
+  uint8_t buf[PROBE_RECORD_SIZE];
+  store_le32(buf, (uint32_t) (uint64_t) rec->time_us);
+  store_le32(buf + 4, (uint32_t) ((uint64_t) rec->time_us >> 32));
+  store_le32(buf + 8, rec->id);
+  store_le32(buf + 12, (uint32_t) rec->value);
+  buf[16] = rec->point;
+  buf[17] = rec->index;
+  buf[18] = rec->kind;
+  buf[19] = 0;
+  fwrite(buf, 1, sizeof(buf), probe_log.file);
+  probe_log.dirty = true;
+}
+
+static void probe_open_log(const char *path) {
+  uint8_t header[PROBE_HEADER_SIZE];
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd >= 0)
+    probe_log.file = fdopen(fd, "wb");
+  if (probe_log.file == NULL) {
+    fprintf(stderr, "FATAL ERROR: Could not create probe log '%s': %s\n",
+      path, strerror(errno));
     exit(1);
   }
+  memcpy(header, PROBE_MAGIC, TRACE_MAGIC_SIZE);
+  store_le32(header + TRACE_MAGIC_SIZE, PROBE_VERSION);
+  fwrite(header, 1, sizeof(header), probe_log.file);
+  probe_log.dirty = true;
+}
+
+static void probe_dump(void) {
+  static const char *point_names[] = {
+    [PROBE_RECEIVE] = "receive",
+    [PROBE_ENQUEUE] = "enqueue",
+    [PROBE_COALESCE] = "coalesce",
+    [PROBE_RELEASE] = "release",
+    [PROBE_COMMIT] = "commit",
+    [PROBE_BUFFER_RELEASE] = "buffer_release",
+  };
+  uint64_t first = probe_log.count > PROBE_RING_SIZE
+    ? probe_log.count - PROBE_RING_SIZE : 0;
+  for (uint64_t i = first; i < probe_log.count; ++i) {
+    const struct probe_record *rec
+      = &probe_log.ring[i & (PROBE_RING_SIZE - 1)];
+    fprintf(stderr,
+      "kloak probe: time_us=%" PRId64 " point=%s index=%u kind=%u"
+      " id=%" PRIu32 " value=%" PRId32 "\n",
+      rec->time_us, point_names[rec->point], rec->index, rec->kind, rec->id,
+      rec->value);
+  }
+}
+
+static void trace_flush(void) {
+  if (probe_log.file != NULL && probe_log.dirty) {
+    fflush(probe_log.file);
+    probe_log.dirty = false;
+  }
+  if (trace_writer.file == NULL || !trace_writer.dirty)
+    return;
+  fflush(trace_writer.file);
+  trace_writer.dirty = false;
+}
+
+/********************/
+/* wayland handling */
+/********************/
+
+static void registry_handle_global(void *data, struct wl_registry *registry,
+  uint32_t name, const char *interface, uint32_t version) {
+  struct disp_state *state = data;
+  if (strcmp(interface, wl_compositor_interface.name) == 0) {
+    state->compositor = wl_registry_bind(registry, name,
+      &wl_compositor_interface, 5);
+  } else if (strcmp(interface, wl_seat_interface.name) == 0) {
+    /*
+     * Every seat is bound, which of them kloak serves is only known once
+     * its name arrives.
+     */
+    if (state->seat_binding_count == MAX_WAYLAND_SEATS) {
+      fprintf(stderr,
+        "WARNING: More than %d seats detected, the rest will be ignored.\n",
+        MAX_WAYLAND_SEATS);
+      return;
+    }
+    struct seat_binding *binding = calloc(1, sizeof(*binding));
+    if (!binding) {
+      fprintf(stderr, "FATAL ERROR: Could not allocate seat binding!\n");
+      exit(1);
+    }
+    binding->seat = wl_registry_bind(registry, name, &wl_seat_interface, 9);
+    wl_seat_add_listener(binding->seat, &seat_listener, binding);
+    state->seat_bindings[state->seat_binding_count++] = binding;
+  } else if (strcmp(interface, wl_shm_interface.name) == 0) {
+    state->shm = wl_registry_bind(registry, name, &wl_shm_interface, 2);
+  } else if (strcmp(interface, wl_output_interface.name) == 0) {
+    struct wl_output *output = wl_registry_bind(registry, name,
+      &wl_output_interface, 4);
+    struct drawable_layer *layer = allocate_drawable_layer(state, output);
+    layer->output_name = name;
+    if (state->xdg_output_manager) {
+      /*
+       * We can only create xdg_outputs for wl_outputs if we've received the
+       * zxdg_output_manager_v1 object from the server, thus the 'if'
+       * condition here. When we *do* get the zxdg_output_manager_v1 object,
+       * we go through and make xdg_outputs for any wl_outputs that were sent
+       * too early.
+       *
+       * NOTE: We do not add wl_output listeners until we have the
+       * zxdg_output_manager_v1 object to avoid the situation where we get
+       * wl_output_done signals before an xdg_output is created for a
+       * wl_output.
+       */
+      attach_xdg_output(state, layer);
+    }
+  } else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0) {
+    state->xdg_output_manager = wl_registry_bind(registry, name,
+      &zxdg_output_manager_v1_interface, 3);
+    for (size_t i = 0; i < state->layer_count; ++i) {
+      if (!state->layers[i]->xdg_output) {
+        /* This is where we make xdg_outputs for any wl_outputs that were
+         * sent too early. */
+        attach_xdg_output(state, state->layers[i]);
+      }
+    }
+  } else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
+    state->layer_shell = wl_registry_bind(registry, name,
+      &zwlr_layer_shell_v1_interface, 4);
+  } else if (
+    strcmp(interface, zwlr_virtual_pointer_manager_v1_interface.name) == 0) {
+    if (backend != &wayland_backend)
+      return;
+    state->virt_pointer_manager = wl_registry_bind(registry, name,
+      &zwlr_virtual_pointer_manager_v1_interface, 2);
+  } else if (
+    strcmp(interface, zwp_virtual_keyboard_manager_v1_interface.name) == 0) {
+    state->virt_kb_manager = wl_registry_bind(registry, name,
+      &zwp_virtual_keyboard_manager_v1_interface, 1);
+  }
+}
+
+static void registry_handle_global_remove(void *data,
+  struct wl_registry *registry, uint32_t name) {
+  struct disp_state *state = data;
+  for (size_t i = 0; i < state->layer_count; ++i) {
+    struct drawable_layer *layer = state->layers[i];
+    if (layer->output_name != name)
+      continue;
+    remove_drawable_layer(state, layer);
+    zwlr_layer_surface_v1_destroy(layer->layer_surface);
+    wl_output_release(layer->output);
+    if (layer->xdg_output) {
+      zxdg_output_v1_destroy(layer->xdg_output);
+    }
+    destroy_layer_buffers(layer);
+    if (layer->frame_callback) {
+      wl_callback_destroy(layer->frame_callback);
+    }
+    wl_surface_destroy(layer->surface);
+    free(layer);
+    /*
+     * Indices shifted and the forest may have lost a bridge between two
+     * screens, so both the index and the topology have to be redone. Until
+     * then, make sure nothing looks up a layer that no longer exists.
+     */
+    state->output_index.len = 0;
+    state->output_index.last_hit = 0;
+    schedule_global_space_recalc(state, true);
+    break;
+  }
+}
+
+static void seat_binding_update_keyboard(struct seat_binding *binding) {
+  struct seat_context *ctx = binding->ctx;
+  /* Keyboards are attached once applayer_wayland_init() has created the
+   * virtual devices and the XKB context the keymap is handed to. */
+  if (!ctx || !state.xkb_ctx)
+    return;
+  if ((binding->caps & WL_SEAT_CAPABILITY_KEYBOARD) && !ctx->kb) {
+    ctx->kb = wl_seat_get_keyboard(binding->seat);
+    wl_keyboard_add_listener(ctx->kb, &kb_listener, ctx);
+  } else if (!(binding->caps & WL_SEAT_CAPABILITY_KEYBOARD) && ctx->kb) {
+    /* The last compiled keymap stays in use until a keyboard returns. */
+    wl_keyboard_release(ctx->kb);
+    ctx->kb = NULL;
+  }
+}
+
+static void seat_handle_name(void *data, struct wl_seat *seat,
+  const char *name) {
+  struct seat_binding *binding = data;
+  if (binding->name)
+    return;
+  binding->name = strdup(name);
+  if (!binding->name) {
+    fprintf(stderr, "FATAL ERROR: Could not allocate seat name!\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < seat_count; ++i) {
+    struct seat_context *ctx = &seats[i];
+    if (ctx->binding)
+      continue;
+    if (!ctx->match_any_wl_seat && strcmp(ctx->name, name) != 0)
+      continue;
+    ctx->binding = binding;
+    binding->ctx = ctx;
+    seat_binding_update_keyboard(binding);
+    return;
+  }
+}
+
+static void seat_handle_capabilities(void *data, struct wl_seat *seat,
+  uint32_t capabilities) {
+  struct seat_binding *binding = data;
+  binding->caps = capabilities;
+  seat_binding_update_keyboard(binding);
+}
+
+static void kb_handle_keymap(void *data, struct wl_keyboard *kb,
+  uint32_t format, int32_t fd, uint32_t size) {
+  struct seat_context *seat = data;
+  char *kb_map_shm = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (kb_map_shm == MAP_FAILED) {
+    fprintf(stderr, "FATAL ERROR: Could not mmap xkb layout!\n");
+    exit(1);
+  }
+  uint64_t hash = hash_bytes(kb_map_shm, size);
+  struct keymap_cache *cache = &seat->keymap_cache;
+  struct keymap_cache_entry *entry = keymap_cache_lookup(cache, hash,
+    kb_map_shm, size);
+  if (entry && entry == cache->active) {
+    /* New and old maps are the same, cleanup and return. */
+    munmap(kb_map_shm, size);
+    close(fd);
+    return;
+  }
+  if (seat->virt_kb)
+    zwp_virtual_keyboard_v1_keymap(seat->virt_kb, format, fd, size);
   close(fd);
-  if (state->xkb_state) {
-    xkb_state_unref(state->xkb_state);
+  if (entry) {
+    /* A layout we have compiled before, the cache keeps its own copy of
+     * the text. */
+    munmap(kb_map_shm, size);
+    ++metrics.keymap_cache_hits;
+  } else {
+    struct xkb_keymap *keymap = xkb_keymap_new_from_string(
+      state.xkb_ctx, kb_map_shm, XKB_KEYMAP_FORMAT_TEXT_V1,
+      XKB_KEYMAP_COMPILE_NO_FLAGS);
+    if (!keymap) {
+      fprintf(stderr, "FATAL ERROR: Could not compile xkb layout!\n");
+      exit(1);
+    }
+    entry = keymap_cache_insert(cache, hash, kb_map_shm, size, keymap);
+    ++metrics.keymap_cache_misses;
   }
-  state->xkb_state = xkb_state_new(state->xkb_keymap);
-  if (!state->xkb_state) {
+  cache->active = entry;
+  seat->xkb_keymap = entry->keymap;
+  if (seat->xkb_state) {
+    xkb_state_unref(seat->xkb_state);
+  }
+  seat->xkb_state = xkb_state_new(seat->xkb_keymap);
+  if (!seat->xkb_state) {
     fprintf(stderr, "FATAL ERROR: Could not create xkb state!\n");
     exit(1);
   }
-  state->virt_kb_keymap_set = true;
+  seat->virt_kb_keymap_set = true;
+  /* The compositor resets modifier state along with the keymap. */
+  seat->sent_mods_valid = false;
 }
 
 static void kb_handle_enter(void *data, struct wl_keyboard *kb,
@@ -682,16 +1785,10 @@ static void kb_handle_repeat_info(void *data, struct wl_keyboard *kb,
 }
 
 static void wl_buffer_release(void *data, struct wl_buffer *buffer) {
-  for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-    if (state.layers[i]) {
-      if (state.layers[i]->buffer == buffer) {
-        state.layers[i]->frame_released = true;
-        state.layers[i]->buffer = NULL;
-        break;
-      }
-    }
-  }
-  wl_buffer_destroy(buffer);
+  struct layer_buffer *layer_buf = data;
+  layer_buf->busy = false;
+  probe_record(PROBE_BUFFER_RELEASE, layer_buf->layer->idx, 0,
+    (uint32_t) (layer_buf - layer_buf->layer->buffers), 0, current_time_us());
 }
 
 static void wl_output_handle_geometry(void *data, struct wl_output *output,
@@ -702,22 +1799,30 @@ static void wl_output_handle_geometry(void *data, struct wl_output *output,
 
 static void wl_output_handle_mode(void *data, struct wl_output *output,
   uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
-  ;
+  struct drawable_layer *layer = data;
+  if (!(flags & WL_OUTPUT_MODE_CURRENT))
+    return;
+  layer->refresh_mhz = refresh;
 }
 
 static void wl_output_info_done(void *data, struct wl_output *output) {
-  struct disp_state *state = data;
-  for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-    if (state->outputs[i] == output) {
-      struct output_geometry *geometry = state->pending_output_geometries[i];
-      if (geometry->x == 0 && geometry->y == 0 && geometry->width == 0
-        && geometry->height == 0)
-        return;
-      state->output_geometries[i] = state->pending_output_geometries[i];
-      recalc_global_space(state);
-      break;
-    }
-  }
+  struct drawable_layer *layer = data;
+  struct output_geometry *geometry = &layer->pending_geometry;
+  if (geometry->x == 0 && geometry->y == 0 && geometry->width == 0
+    && geometry->height == 0)
+    return;
+  if (layer->geometry_valid
+    && memcmp(&layer->geometry, geometry, sizeof(*geometry)) == 0)
+    return;
+  /*
+   * A new screen can be joined to the existing topology, but a screen that
+   * moved may have been holding two others together, so that requires a
+   * rebuild. Either way the work is deferred until the whole burst of output
+   * events has been dispatched.
+   */
+  schedule_global_space_recalc(layer->state, layer->geometry_valid);
+  layer->geometry = *geometry;
+  layer->geometry_valid = true;
 }
 
 static void wl_output_handle_scale(void *data, struct wl_output *output,
@@ -737,26 +1842,16 @@ static void wl_output_handle_description(void *data, struct wl_output *output,
 
 static void xdg_output_handle_logical_position(void *data,
   struct zxdg_output_v1 *xdg_output, int32_t x, int32_t y) {
-  struct disp_state *state = data;
-  for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-    if (state->xdg_outputs[i] == xdg_output) {
-      state->pending_output_geometries[i]->x = x;
-      state->pending_output_geometries[i]->y = y;
-      break;
-    }
-  }
+  struct drawable_layer *layer = data;
+  layer->pending_geometry.x = x;
+  layer->pending_geometry.y = y;
 }
 
 static void xdg_output_handle_logical_size(void *data,
   struct zxdg_output_v1 *xdg_output, int32_t width, int32_t height) {
-  struct disp_state *state = data;
-  for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-    if (state->xdg_outputs[i] == xdg_output) {
-      state->pending_output_geometries[i]->width = width;
-      state->pending_output_geometries[i]->height = height;
-      break;
-    }
-  }
+  struct drawable_layer *layer = data;
+  layer->pending_geometry.width = width;
+  layer->pending_geometry.height = height;
 }
 
 static void xdg_output_info_done(void *data,
@@ -774,140 +1869,539 @@ static void xdg_output_handle_description(void *data,
   ;
 }
 
+static void layer_frame_done(void *data, struct wl_callback *callback,
+  uint32_t callback_data) {
+  struct drawable_layer *layer = data;
+  wl_callback_destroy(callback);
+  layer->frame_callback = NULL;
+  ++layer->frames_presented;
+}
+
 static void layer_surface_configure(void *data,
   struct zwlr_layer_surface_v1 *layer_surface, uint32_t serial, uint32_t width,
   uint32_t height) {
-  struct disp_state *state = data;
-  struct drawable_layer *layer;
-  for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-    if (state->layers[i]) {
-      if (state->layers[i]->layer_surface == layer_surface) {
-        layer = state->layers[i];
-        break;
+  struct drawable_layer *layer = data;
+  struct disp_state *state = layer->state;
+  if (!layer->pool_data || layer->width != width
+    || layer->height != height) {
+    destroy_layer_buffers(layer);
+    layer->width = width;
+    layer->height = height;
+    layer->stride = width * 4;
+    layer->size = layer->stride * (size_t) height;
+    layer->pool_size = layer->size * LAYER_BUFFER_COUNT;
+    int shm_fd = create_shm_file(layer->pool_size);
+    if (shm_fd == -1) {
+      fprintf(stderr,
+        "FATAL ERROR: Cannot allocate shared memory block for frame: %s\n",
+        strerror(errno));
+      exit(1);
+    }
+    layer->pool_data = mmap(NULL, layer->pool_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED, shm_fd, 0);
+    if (layer->pool_data == MAP_FAILED) {
+      layer->pool_data = NULL;
+      close(shm_fd);
+      fprintf(stderr,
+        "FATAL ERROR: Failed to map shared memory block for frame: %s\n",
+        strerror(errno));
+      exit(1);
+    }
+    layer->shm_pool = wl_shm_create_pool(state->shm, shm_fd,
+      layer->pool_size);
+    close(shm_fd);
+    if (realtime.enabled) {
+      realtime.prefaulted_bytes += prefault_memory(layer->pool_data,
+        layer->pool_size);
+    }
+
+    /*
+     * All of the layer's buffers are carved out of the one pool and live
+     * for as long as the layer keeps its size. They start out fully
+     * transparent, since the shm file is zero-filled.
+     */
+    for (size_t i = 0; i < LAYER_BUFFER_COUNT; ++i) {
+      struct layer_buffer *layer_buf = &layer->buffers[i];
+      layer_buf->pixbuf = layer->pool_data + (i * layer->size / 4);
+      layer_buf->buffer = wl_shm_pool_create_buffer(layer->shm_pool,
+        i * layer->size, layer->width, layer->height, layer->stride,
+        WL_SHM_FORMAT_ARGB8888);
+      wl_buffer_add_listener(layer_buf->buffer, &buffer_listener, layer_buf);
+      layer_buf->layer = layer;
+      layer_buf->busy = false;
+      for (size_t j = 0; j < MAX_SEATS; ++j) {
+        layer_buf->drawn_cursor_x[j] = -1;
+        layer_buf->drawn_cursor_y[j] = -1;
       }
     }
+    for (size_t i = 0; i < MAX_SEATS; ++i) {
+      layer->last_drawn_cursor_x[i] = -1;
+      layer->last_drawn_cursor_y[i] = -1;
+    }
+    mark_layer_dirty(layer);
+
+    /*
+     * If the compositor didn't give us the small surface we asked for, treat
+     * whatever we got as a full-output canvas.
+     */
+    layer->cursor_sized = render_mode == RENDER_MODE_CURSOR
+      && width == CURSOR_SURFACE_SIZE && height == CURSOR_SURFACE_SIZE;
+    layer->origin_x = 0;
+    layer->origin_y = 0;
   }
-  layer->width = width;
-  layer->height = height;
-  layer->stride = width * 4;
-  layer->size = layer->stride * (size_t) height;
-  int shm_fd = create_shm_file(layer->size);
-  if (shm_fd == -1) {
-    fprintf(stderr,
-      "FATAL ERROR: Cannot allocate shared memory block for frame: %s\n",
-      strerror(errno));
-    exit(1);
+
+  struct wl_region *zeroed_region = wl_compositor_create_region(
+    state->compositor);
+  wl_region_add(zeroed_region, 0, 0, 0, 0);
+  wl_surface_set_input_region(layer->surface, zeroed_region);
+
+  zwlr_layer_surface_v1_ack_configure(layer_surface, serial);
+  layer->layer_surface_configured = true;
+  wl_region_destroy(zeroed_region);
+  draw_frame(layer);
+}
+
+/*********************/
+/* libinput handling */
+/*********************/
+
+static int li_open_restricted(const char *path, int flags, void *user_data) {
+  int fd = open(path, flags);
+  int one = 1;
+  /* Never pick up (let alone grab) our own uinput device. */
+  char phys[sizeof(UINPUT_PHYS) + 1] = { 0 };
+  if (fd >= 0 && ioctl(fd, EVIOCGPHYS(sizeof(phys) - 1), phys) >= 0
+    && strcmp(phys, UINPUT_PHYS) == 0) {
+    close(fd);
+    return -ENODEV;
   }
-  layer->pixbuf = mmap(NULL, layer->size, PROT_READ | PROT_WRITE,
-    MAP_SHARED, shm_fd, 0);
-  if (layer->pixbuf == MAP_FAILED) {
-    close(shm_fd);
-    fprintf(stderr,
-      "FATAL ERROR: Failed to map shared memory block for frame: %s\n",
-      strerror(errno));
+  if (ioctl(fd, EVIOCGRAB, &one) < 0) {
+    fprintf(stderr, "FATAL ERROR: Could not grab evdev device '%s'!\n", path);
     exit(1);
   }
-  layer->shm_pool = wl_shm_create_pool(state->shm, shm_fd,
-    layer->size);
+  return fd < 0 ? -errno : fd;
+}
+
+static void li_close_restricted(int fd, void *user_data) {
+  close(fd);
+}
+
+/*******************/
+/* output backends */
+/*******************/
+
+static void wayland_backend_motion(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t x, uint32_t y, uint32_t x_extent,
+  uint32_t y_extent) {
+  zwlr_virtual_pointer_v1_motion_absolute(seat->virt_pointer,
+    ts_milliseconds, x, y, x_extent, y_extent);
+}
+
+static void wayland_backend_button(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t button, bool pressed) {
+  /* Both libinput and zwlr_virtual_pointer_v1 use evdev event codes to
+   * identify the button pressed, so we can just pass the data from
+   * libinput straight through */
+  zwlr_virtual_pointer_v1_button(seat->virt_pointer, ts_milliseconds, button,
+    pressed ? WL_POINTER_BUTTON_STATE_PRESSED
+    : WL_POINTER_BUTTON_STATE_RELEASED);
+}
+
+static void wayland_backend_axis(struct seat_context *seat,
+  uint32_t ts_milliseconds, enum scroll_axis axis, double value) {
+  enum wl_pointer_axis wl_axis = axis == SCROLL_AXIS_VERTICAL
+    ? WL_POINTER_AXIS_VERTICAL_SCROLL : WL_POINTER_AXIS_HORIZONTAL_SCROLL;
+  if (value == 0) {
+    zwlr_virtual_pointer_v1_axis_stop(seat->virt_pointer, ts_milliseconds,
+      wl_axis);
+  } else {
+    zwlr_virtual_pointer_v1_axis(seat->virt_pointer, ts_milliseconds, wl_axis,
+      wl_fixed_from_double(value));
+  }
+}
+
+static void wayland_backend_axis_source(struct seat_context *seat,
+  enum scroll_source source) {
+  enum wl_pointer_axis_source wl_source;
+  switch (source) {
+    case SCROLL_SOURCE_FINGER:
+      wl_source = WL_POINTER_AXIS_SOURCE_FINGER;
+      break;
+    case SCROLL_SOURCE_CONTINUOUS:
+      wl_source = WL_POINTER_AXIS_SOURCE_CONTINUOUS;
+      break;
+    default:
+      wl_source = WL_POINTER_AXIS_SOURCE_WHEEL;
+      break;
+  }
+  zwlr_virtual_pointer_v1_axis_source(seat->virt_pointer, wl_source);
+}
+
+static void wayland_backend_frame(struct seat_context *seat) {
+  zwlr_virtual_pointer_v1_frame(seat->virt_pointer);
+}
+
+static void wayland_backend_modifiers(struct seat_context *seat,
+  const struct kb_modifiers *mods) {
+  zwp_virtual_keyboard_v1_modifiers(seat->virt_kb, mods->depressed,
+    mods->latched, mods->locked, mods->group);
+}
+
+static void wayland_backend_key(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t key, bool pressed) {
+  /* The compositor rejects key events until a keymap has been sent. */
+  if (!seat->virt_kb_keymap_set)
+    return;
+  zwp_virtual_keyboard_v1_key(seat->virt_kb, ts_milliseconds, key,
+    pressed ? WL_KEYBOARD_KEY_STATE_PRESSED : WL_KEYBOARD_KEY_STATE_RELEASED);
+}
+
+static void wayland_backend_flush(struct seat_context *seat) {
+  wl_display_flush(state.display);
+}
+
+static void null_backend_motion(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t x, uint32_t y, uint32_t x_extent,
+  uint32_t y_extent) {}
+static void null_backend_button(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t button, bool pressed) {}
+static void null_backend_axis(struct seat_context *seat,
+  uint32_t ts_milliseconds, enum scroll_axis axis, double value) {}
+static void null_backend_axis_source(struct seat_context *seat,
+  enum scroll_source source) {}
+static void null_backend_frame(struct seat_context *seat) {}
+static void null_backend_modifiers(struct seat_context *seat,
+  const struct kb_modifiers *mods) {}
+static void null_backend_key(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t key, bool pressed) {}
+static void null_backend_flush(struct seat_context *seat) {}
+
+static void null_backend_draw_layer(struct drawable_layer *layer) {
+  layer->frame_pending = false;
+}
+
+/*
+ * The counting backend tallies the requests the Wayland backend would have
+ * made, and their size on the wire: an 8 byte header plus 4 bytes per
+ * argument.
+ */
+static void counting_backend_motion(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t x, uint32_t y, uint32_t x_extent,
+  uint32_t y_extent) {
+  ++backend_counters.motion;
+  backend_counters.bytes += 8 + 5 * 4;
+}
+
+static void counting_backend_button(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t button, bool pressed) {
+  ++backend_counters.button;
+  backend_counters.bytes += 8 + 3 * 4;
+}
+
+static void counting_backend_axis(struct seat_context *seat,
+  uint32_t ts_milliseconds, enum scroll_axis axis, double value) {
+  ++backend_counters.axis;
+  backend_counters.bytes += 8 + (value == 0 ? 2 : 3) * 4;
+}
+
+static void counting_backend_axis_source(struct seat_context *seat,
+  enum scroll_source source) {
+  ++backend_counters.axis_source;
+  backend_counters.bytes += 8 + 4;
+}
+
+static void counting_backend_frame(struct seat_context *seat) {
+  ++backend_counters.frame;
+  backend_counters.bytes += 8;
+}
+
+static void counting_backend_modifiers(struct seat_context *seat,
+  const struct kb_modifiers *mods) {
+  ++backend_counters.modifiers;
+  backend_counters.bytes += 8 + 4 * 4;
+}
+
+static void counting_backend_key(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t key, bool pressed) {
+  ++backend_counters.key;
+  backend_counters.bytes += 8 + 3 * 4;
+}
+
+static void counting_backend_flush(struct seat_context *seat) {
+  ++backend_counters.flush;
+}
+
+static void counting_backend_draw_layer(struct drawable_layer *layer) {
+  ++backend_counters.draw;
+  layer->frame_pending = false;
+}
+
+static void uinput_device_write(void) {
+  size_t len = uinput_device.len * sizeof(struct input_event);
+  uint8_t *buf = (uint8_t *) uinput_device.buf;
+  while (len > 0) {
+    ssize_t written = write(uinput_device.fd, buf, len);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "FATAL ERROR: Could not write to uinput device: %s\n",
+        strerror(errno));
+      exit(1);
+    }
+    buf += written;
+    len -= (size_t) written;
+  }
+  uinput_device.len = 0;
+}
+
+static void uinput_backend_append(uint16_t type, uint16_t code,
+  int32_t value) {
+  if (uinput_device.len == UINPUT_BUF_EVENTS)
+    uinput_device_write();
+  /* The kernel timestamps uinput events itself. */
+  uinput_device.buf[uinput_device.len++] = (struct input_event) {
+    .type = type,
+    .code = code,
+    .value = value,
+  };
+}
+
+static void uinput_backend_motion(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t x, uint32_t y, uint32_t x_extent,
+  uint32_t y_extent) {
+  /* The compositor maps the absolute axes onto its whole layout, which is
+   * the same box as kloak's pointer space. */
+  uinput_backend_append(EV_ABS, ABS_X,
+    (int32_t) ((uint64_t) x * UINPUT_ABS_MAX / max(x_extent, 1)));
+  uinput_backend_append(EV_ABS, ABS_Y,
+    (int32_t) ((uint64_t) y * UINPUT_ABS_MAX / max(y_extent, 1)));
+}
+
+static void uinput_backend_button(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t button, bool pressed) {
+  uinput_backend_append(EV_KEY, (uint16_t) button, pressed ? 1 : 0);
+}
+
+static void uinput_backend_axis(struct seat_context *seat,
+  uint32_t ts_milliseconds, enum scroll_axis axis, double value) {
+  /* evdev has no axis stop. */
+  if (value == 0)
+    return;
+  /*
+   * Wayland axis values are 15 units per wheel detent, evdev high
+   * resolution wheel values 120. evdev's vertical wheel counts upwards,
+   * the opposite of Wayland. Whole detents are also reported on the low
+   * resolution axis, which is what most clients still read.
+   */
+  bool vert = axis == SCROLL_AXIS_VERTICAL;
+  double v120 = value * 8.0 * (vert ? -1.0 : 1.0);
+  int32_t hi_res = (int32_t) round(v120);
+  if (hi_res == 0)
+    return;
+  uinput_backend_append(EV_REL, vert ? REL_WHEEL_HI_RES : REL_HWHEEL_HI_RES,
+    hi_res);
+  int32_t *remainder = &uinput_device.wheel_remainder[vert ? 0 : 1];
+  *remainder += hi_res;
+  int32_t detents = *remainder / 120;
+  if (detents != 0) {
+    uinput_backend_append(EV_REL, vert ? REL_WHEEL : REL_HWHEEL, detents);
+    *remainder -= detents * 120;
+  }
+}
 
-  struct wl_region *zeroed_region = wl_compositor_create_region(
-    state->compositor);
-  wl_region_add(zeroed_region, 0, 0, 0, 0);
-  wl_surface_set_input_region(layer->surface, zeroed_region);
+static void uinput_backend_axis_source(struct seat_context *seat,
+  enum scroll_source source) {
+  /* evdev only knows wheels. */
+}
 
-  zwlr_layer_surface_v1_ack_configure(layer_surface, serial);
-  layer->layer_surface_configured = true;
-  wl_region_destroy(zeroed_region);
-  draw_frame(layer);
+static void uinput_backend_frame(struct seat_context *seat) {
+  uinput_backend_append(EV_SYN, SYN_REPORT, 0);
 }
 
-/*********************/
-/* libinput handling */
-/*********************/
+static void uinput_backend_modifiers(struct seat_context *seat,
+  const struct kb_modifiers *mods) {
+  /* The compositor derives modifier state from the keys themselves. */
+}
 
-static int li_open_restricted(const char *path, int flags, void *user_data) {
-  int fd = open(path, flags);
-  int one = 1;
-  if (ioctl(fd, EVIOCGRAB, &one) < 0) {
-    fprintf(stderr, "FATAL ERROR: Could not grab evdev device '%s'!\n", path);
-    exit(1);
-  }
-  return fd < 0 ? -errno : fd;
+static void uinput_backend_key(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t key, bool pressed) {
+  /* Keys are not part of a pointer frame, so report them right away. */
+  uinput_backend_append(EV_KEY, (uint16_t) key, pressed ? 1 : 0);
+  uinput_backend_append(EV_SYN, SYN_REPORT, 0);
 }
 
-static void li_close_restricted(int fd, void *user_data) {
-  close(fd);
+static void uinput_backend_flush(struct seat_context *seat) {
+  uinput_device_write();
 }
 
 /************************/
 /* high-level functions */
 /************************/
 
+static void defer_frame(struct drawable_layer *layer) {
+  /* Further wakeups before the frame goes out don't count again. */
+  if (layer->frame_deferred)
+    return;
+  layer->frame_deferred = true;
+  ++layer->frames_skipped;
+}
+
 static void draw_frame(struct drawable_layer *layer) {
-  if (!layer->frame_released)
+  if (!layer->layer_surface_configured) {
+    defer_frame(layer);
     return;
-  if (!layer->layer_surface_configured)
+  }
+  if (layer->frame_callback) {
+    /*
+     * The compositor hasn't shown the last frame yet. Anything that changed
+     * in the meantime will be picked up by the next frame instead.
+     */
+    defer_frame(layer);
     return;
-  layer->frame_pending = false;
-
-  struct wl_buffer *buffer = wl_shm_pool_create_buffer(layer->shm_pool, 0,
-    layer->width, layer->height, layer->stride, WL_SHM_FORMAT_ARGB8888);
+  }
 
-  struct screen_local_coord scr_coord = abs_coord_to_screen_local_coord(
-    (int32_t) cursor_x, (int32_t) cursor_y);
-  struct screen_local_coord prev_scr_coord = abs_coord_to_screen_local_coord(
-    (int32_t) prev_cursor_x, (int32_t) prev_cursor_y);
+  struct layer_buffer *layer_buf = NULL;
+  for (size_t i = 0; i < LAYER_BUFFER_COUNT; ++i) {
+    if (!layer->buffers[i].busy) {
+      layer_buf = &layer->buffers[i];
+      break;
+    }
+  }
+  if (!layer_buf) {
+    /* The compositor is holding every buffer, try again after a release. */
+    defer_frame(layer);
+    return;
+  }
+  layer->frame_pending = false;
+  layer->frame_deferred = false;
 
-  bool cursor_is_on_layer = false;
-  for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-    if (state.layers[i] == layer) {
-      if (i == scr_coord.output_idx) {
-        cursor_is_on_layer = true;
+  /*
+   * Every seat has its own cursor. Work out where each one lands in
+   * buffer-local coordinates, -1 meaning it is not on this layer. For a
+   * full-output layer that's the screen-local position. A cursor-sized layer
+   * is first moved so that it covers the cursor, staying inside the output;
+   * that render mode only allows a single seat.
+   */
+  int32_t buf_x[MAX_SEATS];
+  int32_t buf_y[MAX_SEATS];
+  bool origin_changed = false;
+  for (size_t s = 0; s < seat_count; ++s) {
+    buf_x[s] = -1;
+    buf_y[s] = -1;
+    struct screen_local_coord scr_coord = abs_coord_to_screen_local_coord(
+      (int32_t) seats[s].cursor_x, (int32_t) seats[s].cursor_y);
+    if (!scr_coord.valid || (size_t) scr_coord.output_idx != layer->idx)
+      continue;
+    if (layer->cursor_sized) {
+      struct output_geometry *geometry = &layer->geometry;
+      int32_t new_origin_x = min(scr_coord.x - CURSOR_RADIUS,
+        geometry->width - (int32_t) layer->width);
+      int32_t new_origin_y = min(scr_coord.y - CURSOR_RADIUS,
+        geometry->height - (int32_t) layer->height);
+      new_origin_x = max(new_origin_x, 0);
+      new_origin_y = max(new_origin_y, 0);
+      if (new_origin_x != layer->origin_x
+        || new_origin_y != layer->origin_y) {
+        layer->origin_x = new_origin_x;
+        layer->origin_y = new_origin_y;
+        zwlr_layer_surface_v1_set_margin(layer->layer_surface,
+          layer->origin_y, 0, 0, layer->origin_x);
+        origin_changed = true;
       }
     }
+    buf_x[s] = scr_coord.x - layer->origin_x;
+    buf_y[s] = scr_coord.y - layer->origin_y;
   }
 
-  if (layer->last_drawn_cursor_x >= 0 && layer->last_drawn_cursor_y >= 0) {
-    /* Blank out the previous cursor location */
-    draw_block(layer->pixbuf, layer->last_drawn_cursor_x,
-      layer->last_drawn_cursor_y, layer->width, layer->height,
-      CURSOR_RADIUS, false);
-    damage_surface_enh(layer->surface,
-      layer->last_drawn_cursor_x - CURSOR_RADIUS,
-      layer->last_drawn_cursor_y - CURSOR_RADIUS,
-      layer->last_drawn_cursor_x + CURSOR_RADIUS + 1,
-      layer->last_drawn_cursor_y + CURSOR_RADIUS + 1);
+  /*
+   * The buffer we're about to draw into may be a frame or more behind what's
+   * on screen, so the pixels it needs erased are wherever *it* last had the
+   * cursors drawn. The damage we report, on the other hand, is relative to
+   * the last committed buffer, so that uses the layer-wide positions. All
+   * cursors are erased before any is drawn so that overlapping ones survive.
+   */
+  for (size_t s = 0; s < seat_count; ++s) {
+    if (layer_buf->drawn_cursor_x[s] >= 0
+      && layer_buf->drawn_cursor_y[s] >= 0) {
+      clear_block(layer_buf->pixbuf, layer_buf->drawn_cursor_x[s],
+        layer_buf->drawn_cursor_y[s], layer->width, layer->height,
+        cursor_sprite.rad);
+    }
+  }
+  if (origin_changed) {
+    /* The whole surface moved, so all of it is new. */
+    damage_add(layer, 0, 0, (int32_t) layer->width, (int32_t) layer->height);
+  } else {
+    for (size_t s = 0; s < seat_count; ++s) {
+      if (layer->last_drawn_cursor_x[s] < 0
+        || layer->last_drawn_cursor_y[s] < 0)
+        continue;
+      /* Blank out the previous cursor location */
+      damage_add(layer, layer->last_drawn_cursor_x[s] - cursor_sprite.rad,
+        layer->last_drawn_cursor_y[s] - cursor_sprite.rad, cursor_sprite.size,
+        cursor_sprite.size);
+    }
   }
-  if (cursor_is_on_layer) {
+  for (size_t s = 0; s < seat_count; ++s) {
+    if (buf_x[s] < 0)
+      continue;
     /* Draw red crosshairs at the pointer location */
-    draw_block(layer->pixbuf, scr_coord.x, scr_coord.y, layer->width,
-      layer->height, CURSOR_RADIUS, true);
-    damage_surface_enh(layer->surface, scr_coord.x - CURSOR_RADIUS,
-      scr_coord.y - CURSOR_RADIUS, scr_coord.x + CURSOR_RADIUS + 1,
-      scr_coord.y + CURSOR_RADIUS + 1);
+    blit_sprite(layer_buf->pixbuf, buf_x[s], buf_y[s], layer->width,
+      layer->height, &cursor_sprite);
+    damage_add(layer, buf_x[s] - cursor_sprite.rad,
+      buf_y[s] - cursor_sprite.rad, cursor_sprite.size, cursor_sprite.size);
   }
+  damage_flush(layer);
 
-  wl_buffer_add_listener(buffer, &buffer_listener, NULL);
-  layer->buffer = buffer;
-  wl_surface_attach(layer->surface, buffer, 0, 0);
+  wl_surface_attach(layer->surface, layer_buf->buffer, 0, 0);
+  layer->frame_callback = wl_surface_frame(layer->surface);
+  wl_callback_add_listener(layer->frame_callback, &frame_callback_listener,
+    layer);
   wl_surface_commit(layer->surface);
-  if (cursor_is_on_layer) {
-    layer->last_drawn_cursor_x = scr_coord.x;
-    layer->last_drawn_cursor_y = scr_coord.y;
-  } else {
-    layer->last_drawn_cursor_x = -1;
-    layer->last_drawn_cursor_y = -1;
+  layer_buf->busy = true;
+  ++layer->frames_committed;
+  probe_record(PROBE_COMMIT, layer->idx, 0, (uint32_t) layer->frames_committed,
+    layer->last_frame_damaged_pixels, current_time_us());
+  for (size_t s = 0; s < seat_count; ++s) {
+    layer->last_drawn_cursor_x[s] = buf_x[s];
+    layer->last_drawn_cursor_y[s] = buf_y[s];
+    layer_buf->drawn_cursor_x[s] = buf_x[s];
+    layer_buf->drawn_cursor_y[s] = buf_y[s];
+  }
+}
+
+static void destroy_layer_buffers(struct drawable_layer *layer) {
+  for (size_t i = 0; i < LAYER_BUFFER_COUNT; ++i) {
+    if (layer->buffers[i].buffer) {
+      wl_buffer_destroy(layer->buffers[i].buffer);
+    }
+    layer->buffers[i].buffer = NULL;
+    layer->buffers[i].pixbuf = NULL;
+    layer->buffers[i].busy = false;
+  }
+  if (layer->shm_pool) {
+    wl_shm_pool_destroy(layer->shm_pool);
+    layer->shm_pool = NULL;
+  }
+  if (layer->pool_data) {
+    munmap(layer->pool_data, layer->pool_size);
+    layer->pool_data = NULL;
   }
-  layer->frame_released = false;
 }
 
 static struct drawable_layer *allocate_drawable_layer(struct disp_state *state,
   struct wl_output *output) {
   struct drawable_layer *layer = calloc(1, sizeof(struct drawable_layer));
-  layer->frame_released = true;
-  layer->frame_pending = true;
-  layer->last_drawn_cursor_x = -1;
-  layer->last_drawn_cursor_y = -1;
+  if (layer == NULL) {
+    fprintf(stderr,
+      "FATAL ERROR: Could not allocate memory for drawable layer!\n");
+    exit(1);
+  }
+  layer->state = state;
+  for (size_t i = 0; i < MAX_SEATS; ++i) {
+    layer->last_drawn_cursor_x[i] = -1;
+    layer->last_drawn_cursor_y[i] = -1;
+  }
   layer->output = output;
   layer->surface = wl_compositor_create_surface(state->compositor);
   if (!layer->surface) {
@@ -918,50 +2412,281 @@ static struct drawable_layer *allocate_drawable_layer(struct disp_state *state,
     state->layer_shell, layer->surface, layer->output,
     ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY, "com.kicksecure.kloak");
   zwlr_layer_surface_v1_add_listener(layer->layer_surface,
-    &layer_surface_listener, state);
-
-  zwlr_layer_surface_v1_set_anchor(layer->layer_surface,
-    ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP);
-  zwlr_layer_surface_v1_set_anchor(layer->layer_surface,
-    ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM);
-  zwlr_layer_surface_v1_set_anchor(layer->layer_surface,
-    ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT);
-  zwlr_layer_surface_v1_set_anchor(layer->layer_surface,
-    ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
+    &layer_surface_listener, layer);
+
+  if (render_mode == RENDER_MODE_CURSOR) {
+    /*
+     * A cursor-sized surface pinned to the upper-left corner of the output,
+     * moved around with margins. The exclusive zone of -1 keeps panels from
+     * shifting the origin the margins are measured from.
+     */
+    zwlr_layer_surface_v1_set_anchor(layer->layer_surface,
+      ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT);
+    zwlr_layer_surface_v1_set_size(layer->layer_surface, CURSOR_SURFACE_SIZE,
+      CURSOR_SURFACE_SIZE);
+    zwlr_layer_surface_v1_set_exclusive_zone(layer->layer_surface, -1);
+    zwlr_layer_surface_v1_set_margin(layer->layer_surface, 0, 0, 0, 0);
+  } else {
+    zwlr_layer_surface_v1_set_anchor(layer->layer_surface,
+      ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP);
+    zwlr_layer_surface_v1_set_anchor(layer->layer_surface,
+      ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM);
+    zwlr_layer_surface_v1_set_anchor(layer->layer_surface,
+      ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT);
+    zwlr_layer_surface_v1_set_anchor(layer->layer_surface,
+      ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
+  }
   wl_surface_commit(layer->surface);
 
+  insert_drawable_layer(state, layer);
   return layer;
 }
 
-static void damage_surface_enh(struct wl_surface *surface, int32_t x,
-  int32_t y, int32_t width, int32_t height) {
-  if (x < 0) x = 0;
-  if (y < 0) y = 0;
-  wl_surface_damage_buffer(surface, x, y, width, height);
+static void insert_drawable_layer(struct disp_state *state,
+  struct drawable_layer *layer) {
+  if (state->layer_count == state->layer_capacity) {
+    size_t new_capacity = state->layer_capacity ? state->layer_capacity * 2
+      : INITIAL_LAYER_CAPACITY;
+    struct drawable_layer **new_layers = reallocarray(state->layers,
+      new_capacity, sizeof(struct drawable_layer *));
+    struct drawable_layer **new_dirty_layers = new_layers
+      ? reallocarray(state->dirty_layers, new_capacity,
+      sizeof(struct drawable_layer *)) : NULL;
+    if (new_dirty_layers == NULL) {
+      fprintf(stderr,
+        "FATAL ERROR: Could not allocate memory for drawable layers!\n");
+      exit(1);
+    }
+    state->layers = new_layers;
+    state->dirty_layers = new_dirty_layers;
+    state->layer_capacity = new_capacity;
+  }
+  layer->idx = state->layer_count;
+  state->layers[state->layer_count++] = layer;
+  mark_layer_dirty(layer);
 }
 
-static struct input_packet * update_virtual_cursor(uint32_t ts_milliseconds) {
-  struct screen_local_coord prev_scr_coord = abs_coord_to_screen_local_coord(
-    (int32_t) prev_cursor_x, (int32_t) prev_cursor_y);
+static void attach_xdg_output(struct disp_state *state,
+  struct drawable_layer *layer) {
+  layer->xdg_output = zxdg_output_manager_v1_get_xdg_output(
+    state->xdg_output_manager, layer->output);
+  zxdg_output_v1_add_listener(layer->xdg_output, &xdg_output_listener,
+    layer);
+  wl_output_add_listener(layer->output, &output_listener, layer);
+}
 
-  if (!prev_scr_coord.valid || !state.layers[prev_scr_coord.output_idx]) {
-    /* We've somehow gotten into a spot where the previous coordinate data
-     * either is invalid or points at an area where there is no screen. Reset
-     * everything in the hopes of recovering sanity. */
-    printf("Resetting!\n");
-    for (int32_t i = 0; i < MAX_DRAWABLE_LAYERS; i++) {
-      if (state.layers[i]) {
-        struct coord sane_location = screen_local_coord_to_abs_coord(0, 0, i);
-        prev_cursor_x = sane_location.x;
-        prev_cursor_y = sane_location.y;
-        cursor_x = sane_location.x;
-        cursor_y = sane_location.y;
-        prev_scr_coord = abs_coord_to_screen_local_coord(
-          (int32_t) prev_cursor_x, (int32_t) prev_cursor_y);
+static void remove_drawable_layer(struct disp_state *state,
+  struct drawable_layer *layer) {
+  /* Both tables are unordered, so fill the hole with the last entry. */
+  state->layers[layer->idx] = state->layers[--state->layer_count];
+  state->layers[layer->idx]->idx = layer->idx;
+  if (!layer->dirty_listed)
+    return;
+  for (size_t i = 0; i < state->dirty_count; ++i) {
+    if (state->dirty_layers[i] == layer) {
+      state->dirty_layers[i] = state->dirty_layers[--state->dirty_count];
+      break;
+    }
+  }
+}
+
+static void mark_layer_dirty(struct drawable_layer *layer) {
+  layer->frame_pending = true;
+  if (layer->dirty_listed)
+    return;
+  layer->dirty_listed = true;
+  layer->state->dirty_layers[layer->state->dirty_count++] = layer;
+}
+
+static void request_redraw(struct drawable_layer *layer) {
+  if (layer->frame_pending) {
+    ++layer->updates_coalesced;
+  }
+  mark_layer_dirty(layer);
+}
+
+static int64_t damage_rect_area(const struct damage_rect *rect) {
+  return (int64_t) rect->width * rect->height;
+}
+
+static struct damage_rect damage_rect_union(const struct damage_rect *a,
+  const struct damage_rect *b) {
+  struct damage_rect out_val;
+  out_val.x = min(a->x, b->x);
+  out_val.y = min(a->y, b->y);
+  out_val.width = max(a->x + a->width, b->x + b->width) - out_val.x;
+  out_val.height = max(a->y + a->height, b->y + b->height) - out_val.y;
+  return out_val;
+}
+
+static void damage_add(struct drawable_layer *layer, int32_t x, int32_t y,
+  int32_t width, int32_t height) {
+  struct damage_tracker *damage = &layer->damage;
+
+  /* Clip to the buffer. */
+  int32_t end_x = min(x + width, (int32_t) layer->width);
+  int32_t end_y = min(y + height, (int32_t) layer->height);
+  x = max(x, 0);
+  y = max(y, 0);
+  if (end_x <= x || end_y <= y)
+    return;
+  struct damage_rect rect = {
+    .x = x,
+    .y = y,
+    .width = end_x - x,
+    .height = end_y - y,
+  };
+
+  /*
+   * Fold the new rect into an existing one whenever their bounding box is no
+   * bigger than the two of them separately, which is always the case for a
+   * cursor that only moved a little. Merging can make the result overlap
+   * other rects, so keep going until nothing else merges.
+   */
+  bool merged;
+  do {
+    merged = false;
+    for (size_t i = 0; i < damage->len; ++i) {
+      struct damage_rect bbox = damage_rect_union(&rect, &damage->rects[i]);
+      if (damage_rect_area(&bbox) <= damage_rect_area(&rect)
+        + damage_rect_area(&damage->rects[i])) {
+        rect = bbox;
+        damage->rects[i] = damage->rects[--damage->len];
+        merged = true;
+        break;
+      }
+    }
+  } while (merged);
+
+  if (damage->len == MAX_DAMAGE_RECTS) {
+    /* Out of room, merge with whichever rect grows the least. */
+    size_t best = 0;
+    int64_t best_growth = INT64_MAX;
+    for (size_t i = 0; i < damage->len; ++i) {
+      struct damage_rect bbox = damage_rect_union(&rect, &damage->rects[i]);
+      int64_t growth = damage_rect_area(&bbox)
+        - damage_rect_area(&damage->rects[i]);
+      if (growth < best_growth) {
+        best = i;
+        best_growth = growth;
       }
     }
+    damage->rects[best] = damage_rect_union(&rect, &damage->rects[best]);
+    return;
+  }
+
+  damage->rects[damage->len++] = rect;
+}
+
+static void damage_flush(struct drawable_layer *layer) {
+  struct damage_tracker *damage = &layer->damage;
+  int64_t frame_pixels = 0;
+  for (size_t i = 0; i < damage->len; ++i) {
+    struct damage_rect *rect = &damage->rects[i];
+    wl_surface_damage_buffer(layer->surface, rect->x, rect->y, rect->width,
+      rect->height);
+    frame_pixels += damage_rect_area(rect);
+  }
+  damage->len = 0;
+  layer->last_frame_damaged_pixels = frame_pixels;
+  layer->damaged_pixels += (uint64_t) frame_pixels;
+}
+
+static int64_t axis_exit_offset(int32_t from, int32_t step, int32_t lo,
+  int32_t hi) {
+  if (step > 0)
+    return (int64_t) hi - from;
+  return (int64_t) from - lo + 1;
+}
+
+static int64_t axis_entry_offset(int32_t from, int32_t step, int32_t lo,
+  int32_t hi) {
+  if (step > 0)
+    return (int64_t) lo - from;
+  return (int64_t) from - hi + 1;
+}
+
+static bool axis_pos_range(const struct line_iter *iter, bool x_axis,
+  int32_t lo, int32_t hi, int64_t *first, int64_t *last) {
+  int32_t from = x_axis ? iter->start.x : iter->start.y;
+  int32_t step = x_axis ? iter->step_x : iter->step_y;
+  int64_t entry = axis_entry_offset(from, step, lo, hi);
+  int64_t exit = axis_exit_offset(from, step, lo, hi);
+
+  if (exit <= 0 || entry >= exit)
+    return false;
+  *first = entry <= 0 ? 0 : line_iter_offset_pos(iter, x_axis, entry);
+  *last = line_iter_offset_pos(iter, x_axis, exit);
+  if (*last != INT64_MAX)
+    --*last;
+  return *first != INT64_MAX && *first <= *last;
+}
+
+static int32_t next_walk_event(const struct line_iter *iter,
+  int32_t output_idx, bool end_x_hit, bool end_y_hit) {
+  struct output_geometry *geometry = &state.layers[output_idx]->geometry;
+
+  /*
+   * The walk only ever moves away from its start point in each dimension, so
+   * it leaves the screen at the first position whose offset from the start
+   * point reaches the nearest screen edge in the direction of travel, in
+   * either dimension.
+   */
+  int64_t exit_x = line_iter_offset_pos(iter, true,
+    axis_exit_offset(iter->start.x, iter->step_x, geometry->x,
+    geometry->x + geometry->width));
+  int64_t exit_y = line_iter_offset_pos(iter, false,
+    axis_exit_offset(iter->start.y, iter->step_y, geometry->y,
+    geometry->y + geometry->height));
+  int64_t next = min(exit_x, exit_y);
+
+  /* Both coordinates reach the end point at position major, not before. */
+  if ((!end_x_hit || !end_y_hit) && iter->major > iter->pos) {
+    next = min(next, iter->major);
+  }
+
+  return (int32_t) next;
+}
+
+static int32_t next_offscreen_walk_event(const struct line_iter *iter,
+  bool end_x_hit, bool end_y_hit) {
+  struct output_index *index = &state.output_index;
+  int64_t next = INT64_MAX;
+
+  /* Both coordinates reach the end point at position major, not before. */
+  if ((!end_x_hit || !end_y_hit) && iter->major > iter->pos) {
+    next = iter->major;
+  }
+
+  /*
+   * An off-screen position can only change the walk's state if it is on a
+   * screen, or if the glide check finds a screen one pixel back along one
+   * axis. Both cases lie within a box one pixel larger than the screen
+   * towards the start point. The walk is monotonic in each dimension, so it
+   * is inside that box for a single range of positions, which is the
+   * intersection of the ranges for each axis.
+   */
+  for (size_t i = 0; i < index->len; ++i) {
+    struct output_index_entry *entry = &index->entries[i];
+    int32_t x_lo = iter->step_x > 0 ? entry->x : entry->x - 1;
+    int32_t x_hi = iter->step_x > 0 ? entry->x_end + 1 : entry->x_end;
+    int32_t y_lo = iter->step_y > 0 ? entry->y : entry->y - 1;
+    int32_t y_hi = iter->step_y > 0 ? entry->y_end + 1 : entry->y_end;
+    int64_t first_x, last_x, first_y, last_y;
+    if (!axis_pos_range(iter, true, x_lo, x_hi, &first_x, &last_x)
+      || !axis_pos_range(iter, false, y_lo, y_hi, &first_y, &last_y))
+      continue;
+    int64_t first = max(first_x, first_y);
+    int64_t last = min(last_x, last_y);
+    if (first > last || last <= iter->pos)
+      continue;
+    next = min(next, max(first, (int64_t) iter->pos + 1));
   }
 
+  return (int32_t) next;
+}
+
+static struct coord glide_cursor(struct coord start, struct coord end) {
   /*
    * Ensure the cursor doesn't move off-screen, and recalculate its end
    * position if it would end up off-screen.
@@ -991,19 +2716,24 @@ static struct input_packet * update_virtual_cursor(uint32_t ts_milliseconds) {
    * This sounds like an awful lot of work, but I couldn't find another way to
    * get the mouse to glide smoothly along edges while still respecting them.
    */
-  struct coord start = {
-    .x = (int32_t) prev_cursor_x,
-    .y = (int32_t) prev_cursor_y,
-  };
-  struct coord end = {
-    .x = (int32_t) cursor_x,
-    .y = (int32_t) cursor_y,
-  };
+
+  /*
+   * Walking every pixel is expensive for long moves, so we skip straight to
+   * the next position where something can happen. While the walk is on a
+   * screen, that is where it leaves the screen it's on. While it is off
+   * screen, that is where it comes close enough to a screen to be on it or
+   * glide back onto it. In both cases it is also where the coordinates reach
+   * the end point. Everything in between would not have changed any of the
+   * walk's state, so the result is exactly the same as stepping through
+   * every pixel.
+   */
+  struct line_iter iter;
+  line_iter_init(&iter, start, end);
   struct coord prev_trav_coord = start;
   bool end_x_hit = false;
   bool end_y_hit = false;
-  for (int32_t i = 0; ; ++i) {
-    struct coord trav_coord = traverse_line(start, end, i);
+  for (;;) {
+    struct coord trav_coord = iter.cur;
     if (trav_coord.x == end.x) end_x_hit = true;
     if (trav_coord.y == end.y) end_y_hit = true;
     struct screen_local_coord trav_scr_coord
@@ -1018,7 +2748,7 @@ static struct input_packet * update_virtual_cursor(uint32_t ts_milliseconds) {
           start.x = trav_coord.x - 1;
           start.y = trav_coord.y;
           end.x = trav_coord.x - 1;
-          i = -1;
+          line_iter_init(&iter, start, end);
           continue;
         }
       }
@@ -1029,7 +2759,7 @@ static struct input_packet * update_virtual_cursor(uint32_t ts_milliseconds) {
           start.x = trav_coord.x + 1;
           start.y = trav_coord.y;
           end.x = trav_coord.x + 1;
-          i = -1;
+          line_iter_init(&iter, start, end);
           continue;
         }
       }
@@ -1040,7 +2770,7 @@ static struct input_packet * update_virtual_cursor(uint32_t ts_milliseconds) {
           start.y = trav_coord.y - 1;
           start.x = trav_coord.x;
           end.y = trav_coord.y -1;
-          i = -1;
+          line_iter_init(&iter, start, end);
           continue;
         }
       }
@@ -1051,264 +2781,556 @@ static struct input_packet * update_virtual_cursor(uint32_t ts_milliseconds) {
           start.y = trav_coord.y + 1;
           start.x = trav_coord.x;
           end.y = trav_coord.y + 1;
-          i = -1;
+          line_iter_init(&iter, start, end);
           continue;
         }
       }
     }
     if (end_x_hit && end_y_hit) {
-      if ((int32_t) cursor_x != end.x) {
-        cursor_x = end.x;
-      }
-      if ((int32_t) cursor_y != end.y) {
-        cursor_y = end.y;
+      return end;
+    }
+    int32_t next = trav_scr_coord.valid
+      ? next_walk_event(&iter, trav_scr_coord.output_idx, end_x_hit,
+        end_y_hit)
+      : next_offscreen_walk_event(&iter, end_x_hit, end_y_hit);
+    if (next - 1 == iter.pos) {
+      prev_trav_coord = trav_coord;
+      line_iter_next(&iter);
+    } else {
+      prev_trav_coord = line_iter_coord_at(&iter, next - 1);
+      line_iter_seek(&iter, next);
+    }
+  }
+}
+
+static struct input_packet * update_virtual_cursor(struct seat_context *seat,
+  uint32_t ts_milliseconds) {
+  struct screen_local_coord prev_scr_coord = abs_coord_to_screen_local_coord(
+    (int32_t) seat->prev_cursor_x, (int32_t) seat->prev_cursor_y);
+
+  if (!prev_scr_coord.valid) {
+    /* We've somehow gotten into a spot where the previous coordinate data
+     * either is invalid or points at an area where there is no screen. Reset
+     * everything in the hopes of recovering sanity. */
+    printf("Resetting!\n");
+    for (size_t i = 0; i < state.layer_count; i++) {
+      if (state.layers[i]->geometry_valid) {
+        struct coord sane_location = screen_local_coord_to_abs_coord(0, 0,
+          (int32_t) i);
+        seat->prev_cursor_x = sane_location.x;
+        seat->prev_cursor_y = sane_location.y;
+        seat->cursor_x = sane_location.x;
+        seat->cursor_y = sane_location.y;
+        prev_scr_coord = abs_coord_to_screen_local_coord(
+          (int32_t) seat->prev_cursor_x, (int32_t) seat->prev_cursor_y);
       }
-      break;
     }
-    prev_trav_coord = trav_coord;
+  }
+
+  /* Ensure the cursor doesn't move off-screen, see glide_cursor(). */
+  struct coord start = {
+    .x = (int32_t) seat->prev_cursor_x,
+    .y = (int32_t) seat->prev_cursor_y,
+  };
+  struct coord end = {
+    .x = (int32_t) seat->cursor_x,
+    .y = (int32_t) seat->cursor_y,
+  };
+  end = glide_cursor(start, end);
+  if ((int32_t) seat->cursor_x != end.x) {
+    seat->cursor_x = end.x;
+  }
+  if ((int32_t) seat->cursor_y != end.y) {
+    seat->cursor_y = end.y;
   }
   struct screen_local_coord scr_coord = abs_coord_to_screen_local_coord(
-    (int32_t) cursor_x, (int32_t) cursor_y);
+    (int32_t) seat->cursor_x, (int32_t) seat->cursor_y);
 
-  state.layers[prev_scr_coord.output_idx]->frame_pending = true;
-  state.layers[scr_coord.output_idx]->frame_pending = true;
+  request_redraw(state.layers[prev_scr_coord.output_idx]);
+  if (scr_coord.output_idx != prev_scr_coord.output_idx) {
+    request_redraw(state.layers[scr_coord.output_idx]);
+  }
 
   struct input_packet *old_ev_packet;
   /* = rather than == is intentional here */
-  if ((old_ev_packet = TAILQ_LAST(&head, tailhead))
-    && (!old_ev_packet->is_libinput)) {
-    old_ev_packet->cursor_x = (uint32_t) cursor_x;
-    old_ev_packet->cursor_y = (uint32_t) cursor_y;
+  if ((old_ev_packet = packet_ring_last(&seat->packet_queue))
+    && (old_ev_packet->is_motion)) {
+    old_ev_packet->cursor_x = (uint32_t) seat->cursor_x;
+    old_ev_packet->cursor_y = (uint32_t) seat->cursor_y;
+    ++metrics.motion_coalesced;
     return NULL;
   } else {
-    struct input_packet *ev_packet = calloc(1, sizeof(struct input_packet));
-    if (ev_packet == NULL) {
-      fprintf(stderr,
-        "FATAL ERROR: Could not allocate memory for libinput event packet!\n");
-      exit(1);
-    }
-    ev_packet->is_libinput = false;
-    ev_packet->cursor_x = (uint32_t) cursor_x;
-    ev_packet->cursor_y = (uint32_t) cursor_y;
+    struct input_packet *ev_packet = packet_ring_push(&seat->packet_queue);
+    ev_packet->is_motion = true;
+    ev_packet->cursor_x = (uint32_t) seat->cursor_x;
+    ev_packet->cursor_y = (uint32_t) seat->cursor_y;
     return ev_packet;
   }
 }
 
-static void handle_libinput_event(enum libinput_event_type ev_type,
-  struct libinput_event *li_event, uint32_t ts_milliseconds) {
-  bool mouse_event_handled = false;
+static bool decode_libinput_event(enum libinput_event_type ev_type,
+  struct libinput_event *li_event, struct decoded_event *out) {
+  memset(out, 0, sizeof(*out));
+  out->time_us = libinput_event_time_us(ev_type, li_event);
 
-  if (ev_type == LIBINPUT_EVENT_DEVICE_ADDED) {
-    struct libinput_device *new_dev = libinput_event_get_device(li_event);
-    int can_tap = libinput_device_config_tap_get_finger_count(new_dev);
-    if (can_tap) {
-      libinput_device_config_tap_set_enabled(new_dev,
-        LIBINPUT_CONFIG_TAP_ENABLED);
-    }
+  if (ev_type == LIBINPUT_EVENT_POINTER_MOTION) {
+    struct libinput_event_pointer *pointer_event
+      = libinput_event_get_pointer_event(li_event);
+    out->type = INPUT_EVENT_MOTION;
+    out->dx = libinput_event_pointer_get_dx(pointer_event);
+    out->dy = libinput_event_pointer_get_dy(pointer_event);
+  } else if (ev_type == LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE) {
+    struct libinput_event_pointer *pointer_event
+      = libinput_event_get_pointer_event(li_event);
+    out->type = INPUT_EVENT_MOTION_ABSOLUTE;
+    out->dx = libinput_event_pointer_get_absolute_x_transformed(
+      pointer_event, 1);
+    out->dy = libinput_event_pointer_get_absolute_y_transformed(
+      pointer_event, 1);
   } else if (ev_type == LIBINPUT_EVENT_POINTER_BUTTON) {
-    mouse_event_handled = true;
     struct libinput_event_pointer *pointer_event
       = libinput_event_get_pointer_event(li_event);
-    uint32_t button_code = libinput_event_pointer_get_button(pointer_event);
-    enum libinput_button_state button_state
-      = libinput_event_pointer_get_button_state(pointer_event);
-    if (button_state == LIBINPUT_BUTTON_STATE_PRESSED) {
-      /* Both libinput and zwlr_virtual_pointer_v1 use evdev event codes to
-       * identify the button pressed, so we can just pass the data from
-       * libinput straight through */
-      zwlr_virtual_pointer_v1_button(
-        state.virt_pointer, ts_milliseconds, button_code,
-        WL_POINTER_BUTTON_STATE_PRESSED);
-    } else {
-      zwlr_virtual_pointer_v1_button(
-        state.virt_pointer, ts_milliseconds, button_code,
-        WL_POINTER_BUTTON_STATE_RELEASED);
-    }
-
+    out->type = INPUT_EVENT_BUTTON;
+    out->code = libinput_event_pointer_get_button(pointer_event);
+    out->pressed = libinput_event_pointer_get_button_state(pointer_event)
+      == LIBINPUT_BUTTON_STATE_PRESSED;
   } else if (ev_type == LIBINPUT_EVENT_POINTER_SCROLL_WHEEL
     || ev_type == LIBINPUT_EVENT_POINTER_SCROLL_FINGER
     || ev_type == LIBINPUT_EVENT_POINTER_SCROLL_CONTINUOUS) {
-    mouse_event_handled = true;
     struct libinput_event_pointer *pointer_event
       = libinput_event_get_pointer_event(li_event);
-    int vert_scroll_present = libinput_event_pointer_has_axis(pointer_event,
+    out->type = INPUT_EVENT_SCROLL;
+    if (ev_type == LIBINPUT_EVENT_POINTER_SCROLL_WHEEL) {
+      out->scroll_source = SCROLL_SOURCE_WHEEL;
+    } else if (ev_type == LIBINPUT_EVENT_POINTER_SCROLL_FINGER) {
+      out->scroll_source = SCROLL_SOURCE_FINGER;
+    } else {
+      out->scroll_source = SCROLL_SOURCE_CONTINUOUS;
+    }
+    out->has_vert = libinput_event_pointer_has_axis(pointer_event,
       LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL);
-    int horiz_scroll_present = libinput_event_pointer_has_axis(pointer_event,
+    out->has_horiz = libinput_event_pointer_has_axis(pointer_event,
       LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL);
+    if (out->has_vert) {
+      out->vert = libinput_event_pointer_get_scroll_value(pointer_event,
+        LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL);
+    }
+    if (out->has_horiz) {
+      out->horiz = libinput_event_pointer_get_scroll_value(pointer_event,
+        LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL);
+    }
+  } else if (ev_type == LIBINPUT_EVENT_KEYBOARD_KEY) {
+    struct libinput_event_keyboard *kb_event
+      = libinput_event_get_keyboard_event(li_event);
+    out->type = INPUT_EVENT_KEY;
+    out->code = libinput_event_keyboard_get_key(kb_event);
+    out->pressed = libinput_event_keyboard_get_key_state(kb_event)
+      == LIBINPUT_KEY_STATE_PRESSED;
+  } else {
+    return false;
+  }
+  return true;
+}
 
-    if (vert_scroll_present) {
-      double vert_scroll_value = libinput_event_pointer_get_scroll_value(
-        pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL);
-      if (vert_scroll_value == 0) {
-        zwlr_virtual_pointer_v1_axis_stop(
-          state.virt_pointer, ts_milliseconds,
-          WL_POINTER_AXIS_VERTICAL_SCROLL);
+static void handle_input_packet(struct seat_context *seat,
+  const struct input_packet *packet) {
+  uint32_t ts_milliseconds = (uint32_t) (packet->sched_time / 1000);
+  const struct decoded_event *ev = &packet->ev;
+
+  if (packet->is_motion) {
+    backend->motion(seat, ts_milliseconds,
+      (uint32_t) packet->cursor_x - state.pointer_space_x,
+      (uint32_t) packet->cursor_y - state.pointer_space_y,
+      state.global_space_width - state.pointer_space_x,
+      state.global_space_height - state.pointer_space_y);
+    seat->pointer_frame_open = true;
+
+  } else if (ev->type == INPUT_EVENT_BUTTON) {
+    backend->button(seat, ts_milliseconds, ev->code, ev->pressed);
+    seat->pointer_frame_open = true;
+
+  } else if (ev->type == INPUT_EVENT_SCROLL) {
+    /*
+     * A frame carries at most one value and one source per axis, so a second
+     * scroll event in the same batch has to go into a frame of its own.
+     */
+    if (seat->pointer_frame_has_axis)
+      close_pointer_frame(seat);
+    if (ev->has_vert) {
+      backend->axis(seat, ts_milliseconds, SCROLL_AXIS_VERTICAL, ev->vert);
+      backend->axis_source(seat, ev->scroll_source);
+    }
+    if (ev->has_horiz) {
+      backend->axis(seat, ts_milliseconds, SCROLL_AXIS_HORIZONTAL, ev->horiz);
+      backend->axis_source(seat, ev->scroll_source);
+    }
+    seat->pointer_frame_open = true;
+    seat->pointer_frame_has_axis = true;
+
+  } else if (ev->type == INPUT_EVENT_KEY) {
+    if (seat->xkb_state) {
+      struct kb_modifiers mods = {
+        .depressed = xkb_state_serialize_mods(seat->xkb_state,
+          XKB_STATE_MODS_DEPRESSED),
+        .latched = xkb_state_serialize_mods(seat->xkb_state,
+          XKB_STATE_MODS_LATCHED),
+        .locked = xkb_state_serialize_mods(seat->xkb_state,
+          XKB_STATE_MODS_LOCKED),
+        .group = xkb_state_serialize_layout(seat->xkb_state,
+          XKB_STATE_LAYOUT_EFFECTIVE),
+      };
+      if (!seat->sent_mods_valid
+        || memcmp(&mods, &seat->sent_mods, sizeof(mods)) != 0) {
+        backend->modifiers(seat, &mods);
+        seat->sent_mods = mods;
+        seat->sent_mods_valid = true;
+        ++modifier_updates_sent;
       } else {
-        zwlr_virtual_pointer_v1_axis(state.virt_pointer, ts_milliseconds,
-          WL_POINTER_AXIS_VERTICAL_SCROLL,
-          wl_fixed_from_double(vert_scroll_value));
-      }
-      switch (ev_type) {
-        case LIBINPUT_EVENT_POINTER_SCROLL_WHEEL:
-          zwlr_virtual_pointer_v1_axis_source(state.virt_pointer,
-            WL_POINTER_AXIS_SOURCE_WHEEL);
-          break;
-        case LIBINPUT_EVENT_POINTER_SCROLL_FINGER:
-          zwlr_virtual_pointer_v1_axis_source(state.virt_pointer,
-            WL_POINTER_AXIS_SOURCE_FINGER);
-          break;
-        case LIBINPUT_EVENT_POINTER_SCROLL_CONTINUOUS:
-          zwlr_virtual_pointer_v1_axis_source(state.virt_pointer,
-            WL_POINTER_AXIS_SOURCE_CONTINUOUS);
-          break;
+        ++modifier_updates_skipped;
       }
     }
+    backend->key(seat, ts_milliseconds, ev->code, ev->pressed);
+    if (seat->xkb_state) {
+      /* XKB keycodes == evdev keycodes + 8. Why this design decision was
+       * made, I have no idea. */
+      xkb_state_update_key(seat->xkb_state, ev->code + 8,
+        ev->pressed ? XKB_KEY_DOWN : XKB_KEY_UP);
+    }
+  }
+}
 
-    if (horiz_scroll_present) {
-      double horiz_scroll_value = libinput_event_pointer_get_scroll_value(
-        pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL);
-      if (horiz_scroll_value == 0) {
-        zwlr_virtual_pointer_v1_axis_stop(state.virt_pointer,
-          ts_milliseconds, WL_POINTER_AXIS_HORIZONTAL_SCROLL);
-      } else {
-        zwlr_virtual_pointer_v1_axis(state.virt_pointer,
-          ts_milliseconds, WL_POINTER_AXIS_HORIZONTAL_SCROLL,
-          wl_fixed_from_double(horiz_scroll_value));
-      }
-      switch (ev_type) {
-        case LIBINPUT_EVENT_POINTER_SCROLL_WHEEL:
-          zwlr_virtual_pointer_v1_axis_source(state.virt_pointer,
-            WL_POINTER_AXIS_SOURCE_WHEEL);
-          break;
-        case LIBINPUT_EVENT_POINTER_SCROLL_FINGER:
-          zwlr_virtual_pointer_v1_axis_source(state.virt_pointer,
-            WL_POINTER_AXIS_SOURCE_FINGER);
-          break;
-        case LIBINPUT_EVENT_POINTER_SCROLL_CONTINUOUS:
-          zwlr_virtual_pointer_v1_axis_source(state.virt_pointer,
-            WL_POINTER_AXIS_SOURCE_CONTINUOUS);
-          break;
-      }
+static void finish_input_batch(struct seat_context *seat) {
+  close_pointer_frame(seat);
+  backend->flush(seat);
+}
+
+static void close_pointer_frame(struct seat_context *seat) {
+  if (!seat->pointer_frame_open)
+    return;
+  backend->frame(seat);
+  seat->pointer_frame_open = false;
+  seat->pointer_frame_has_axis = false;
+  ++pointer_frames_sent;
+}
+
+static int64_t delay_window_us(struct seat_context *seat,
+  const struct decoded_event *ev, int64_t event_time) {
+  struct adaptive_delay *ad = &seat->adaptive_delay;
+  int64_t ceiling_us = (int64_t) max_delay * 1000;
+  if (!ad->enabled)
+    return ceiling_us;
+
+  /*
+   * Only discrete events (keys, buttons, scrolling) feed the arrival rate.
+   * Motion arrives at the device's polling rate and would pin the window to
+   * the floor whenever the mouse moves.
+   */
+  if (ev->type != INPUT_EVENT_MOTION
+    && ev->type != INPUT_EVENT_MOTION_ABSOLUTE) {
+    if (ad->last_arrival > 0) {
+      int64_t gap = min(max(event_time - ad->last_arrival, 0), ceiling_us);
+      ad->gap_ewma_us += (gap - ad->gap_ewma_us) / ADAPTIVE_GAP_EWMA_WEIGHT;
+    } else {
+      ad->gap_ewma_us = ceiling_us;
     }
+    ad->last_arrival = event_time;
+  }
 
-  } else if (ev_type == LIBINPUT_EVENT_KEYBOARD_KEY) {
-    if (state.virt_kb_keymap_set) {
-      struct libinput_event_keyboard *kb_event
-        = libinput_event_get_keyboard_event(li_event);
-      uint32_t key = libinput_event_keyboard_get_key(kb_event);
-      enum libinput_key_state key_state
-        = libinput_event_keyboard_get_key_state(kb_event);
-      xkb_mod_mask_t depressed_mods = xkb_state_serialize_mods(
-        state.xkb_state, XKB_STATE_MODS_DEPRESSED);
-      xkb_mod_mask_t latched_mods = xkb_state_serialize_mods(
-        state.xkb_state, XKB_STATE_MODS_LATCHED);
-      xkb_mod_mask_t locked_mods = xkb_state_serialize_mods(
-        state.xkb_state, XKB_STATE_MODS_LOCKED);
-      xkb_layout_index_t effective_group = xkb_state_serialize_layout(
-        state.xkb_state, XKB_STATE_LAYOUT_EFFECTIVE);
-      zwp_virtual_keyboard_v1_modifiers(state.virt_kb, depressed_mods,
-        latched_mods, locked_mods, effective_group);
-      zwp_virtual_keyboard_v1_key(state.virt_kb, ts_milliseconds, key,
-        key_state);
-      if (key_state == LIBINPUT_KEY_STATE_PRESSED) {
-        /* XKB keycodes == evdev keycodes + 8. Why this design decision was
-         * made, I have no idea. */
-        xkb_state_update_key(state.xkb_state, key + 8, XKB_KEY_DOWN);
-      } else {
-        xkb_state_update_key(state.xkb_state, key + 8, XKB_KEY_UP);
+  /*
+   * Once events arrive faster than the window is wide, every new delay is
+   * pushed up by the previous release and the queue settles about a full
+   * window behind. Sizing the window to the arrival gap avoids that, and a
+   * queue that is already backed up shrinks it further. The floor keeps a
+   * minimum amount of jitter no matter how fast the input is.
+   */
+  int64_t window = ad->gap_ewma_us;
+  if (seat->packet_queue.len > ADAPTIVE_QUEUE_DEPTH_TARGET) {
+    window = window * ADAPTIVE_QUEUE_DEPTH_TARGET
+      / (int64_t) seat->packet_queue.len;
+  }
+  window = min(max(window, ad->floor_us), ceiling_us);
+  if (window < ceiling_us)
+    ++ad->shrunk_events;
+  ad->window_us = window;
+  return window;
+}
+
+static bool take_libinput_event(enum libinput_event_type li_event_type,
+  struct libinput_event *li_event, struct decoded_event *ev) {
+  bool forward = false;
+
+  if (li_event_type == LIBINPUT_EVENT_DEVICE_ADDED) {
+    struct libinput_device *new_dev = libinput_event_get_device(li_event);
+    int can_tap = libinput_device_config_tap_get_finger_count(new_dev);
+    if (can_tap) {
+      libinput_device_config_tap_set_enabled(new_dev,
+        LIBINPUT_CONFIG_TAP_ENABLED);
+    }
+  } else {
+    forward = decode_libinput_event(li_event_type, li_event, ev);
+  }
+  libinput_event_destroy(li_event);
+  return forward;
+}
+
+static void queue_libinput_event_and_relocate_virtual_cursor(
+  struct seat_context *seat, enum libinput_event_type li_event_type,
+  struct libinput_event *li_event) {
+  struct decoded_event ev;
+
+  if (take_libinput_event(li_event_type, li_event, &ev)) {
+    int64_t now = current_time_us();
+    probe_record(PROBE_RECEIVE, seat->idx, ev.type, 0,
+      ev.time_us > 0 ? now - ev.time_us : 0, now);
+    /* The trace format has no seat field, so only the first seat is
+     * recorded. */
+    if (seat->idx == 0)
+      trace_record_input_event(&ev);
+    queue_input_event_and_relocate_virtual_cursor(seat, &ev, now);
+  }
+}
+
+static void *capture_thread_main(void *arg) {
+  struct seat_context *seat = arg;
+  struct libinput *li = seat->li;
+  struct pollfd pfd = {
+    .fd = libinput_get_fd(li),
+    .events = POLLIN,
+  };
+  /* Backoff while the ring is full, the main thread drains it far faster
+   * than devices can fill it. */
+  const struct timespec full_wait = { .tv_sec = 0, .tv_nsec = 100000 };
+
+  for (;;) {
+    if (poll(&pfd, 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "FATAL ERROR: Capture thread poll failed: %s\n",
+        strerror(errno));
+      exit(1);
+    }
+    libinput_dispatch(li);
+
+    bool pushed = false;
+    for (;;) {
+      enum libinput_event_type next_ev_type = libinput_next_event_type(li);
+      if (next_ev_type == LIBINPUT_EVENT_NONE)
+        break;
+      struct libinput_event *li_event = libinput_get_event(li);
+      struct capture_entry entry;
+      if (!take_libinput_event(next_ev_type, li_event, &entry.ev))
+        continue;
+      entry.capture_time = current_time_us();
+      while (!capture_ring_push(&seat->capture_ring, &entry)) {
+        atomic_fetch_add_explicit(&seat->capture_ring.full_waits, 1,
+          memory_order_relaxed);
+        nanosleep(&full_wait, NULL);
+      }
+      pushed = true;
+    }
+
+    if (pushed) {
+      uint64_t one = 1;
+      if (write(seat->capture_event_fd, &one, sizeof(one)) < 0
+        && errno != EAGAIN) {
+        fprintf(stderr, "FATAL ERROR: Could not signal capture event: %s\n",
+          strerror(errno));
+        exit(1);
       }
     }
   }
+  return NULL;
+}
 
-  if (mouse_event_handled) {
-    zwlr_virtual_pointer_v1_frame(state.virt_pointer);
+static bool drain_capture_ring(struct seat_context *seat, size_t budget) {
+  uint64_t count;
+  struct capture_entry entry;
+  size_t taken = 0;
+
+  /* Clear the wakeup before draining, so a push that races with us still
+   * leaves the eventfd readable. */
+  if (read(seat->capture_event_fd, &count, sizeof(count)) < 0
+    && errno != EAGAIN) {
+    fprintf(stderr, "FATAL ERROR: Could not read capture event: %s\n",
+      strerror(errno));
+    exit(1);
   }
-  libinput_event_destroy(li_event);
+  while ((budget == 0 || taken < budget)
+    && capture_ring_pop(&seat->capture_ring, &entry)) {
+    ++taken;
+    /* Stamped with the capture time, so it may land slightly out of order
+     * in the probe ring. */
+    probe_record(PROBE_RECEIVE, seat->idx, entry.ev.type, 0,
+      entry.ev.time_us > 0 ? entry.capture_time - entry.ev.time_us : 0,
+      entry.capture_time);
+    if (seat->idx == 0)
+      trace_record_input_event(&entry.ev);
+    queue_input_event_and_relocate_virtual_cursor(seat, &entry.ev,
+      entry.capture_time);
+  }
+  return !capture_ring_empty(&seat->capture_ring);
 }
 
-static void queue_libinput_event_and_relocate_virtual_cursor(
-  enum libinput_event_type li_event_type, struct libinput_event *li_event) {
-  int64_t current_time = current_time_ms();
-  int64_t lower_bound = min(max(prev_release_time - current_time, 0),
-    max_delay);
-  int64_t random_delay = random_between(lower_bound, max_delay);
-  struct input_packet *ev_packet;
+static bool drain_libinput_events(struct seat_context *seat, size_t budget) {
+  size_t taken = 0;
+  for (;;) {
+    enum libinput_event_type next_ev_type
+      = libinput_next_event_type(seat->li);
+    if (next_ev_type == LIBINPUT_EVENT_NONE)
+      return false;
+    if (budget != 0 && taken == budget)
+      return true;
+    struct libinput_event *li_event = libinput_get_event(seat->li);
+    queue_libinput_event_and_relocate_virtual_cursor(seat, next_ev_type,
+      li_event);
+    ++taken;
+  }
+}
 
-  if (li_event_type == LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE) {
-    struct libinput_event_pointer *pointer_event
-      = libinput_event_get_pointer_event(li_event);
-    double abs_x = libinput_event_pointer_get_absolute_x_transformed(
-      pointer_event, state.global_space_width);
-    double abs_y = libinput_event_pointer_get_absolute_y_transformed(
-      pointer_event, state.global_space_height);
-    prev_cursor_x = cursor_x;
-    prev_cursor_y = cursor_y;
-    cursor_x = abs_x;
-    cursor_y = abs_y;
-    ev_packet = update_virtual_cursor((uint32_t) current_time);
-    libinput_event_destroy(li_event);
-    if (!ev_packet) {
+static bool coalesce_scroll_event(struct input_packet *tail,
+  const struct decoded_event *ev) {
+  /* Wheel clicks are discrete steps and keep a packet each. */
+  if (ev->type != INPUT_EVENT_SCROLL
+    || ev->scroll_source == SCROLL_SOURCE_WHEEL)
+    return false;
+  if (!tail || tail->is_motion || tail->ev.type != INPUT_EVENT_SCROLL
+    || tail->ev.scroll_source != ev->scroll_source
+    || tail->ev.has_vert != ev->has_vert
+    || tail->ev.has_horiz != ev->has_horiz)
+    return false;
+  /* A stop ends a scroll sequence, so neither side may be one. */
+  if ((ev->has_vert && (ev->vert == 0 || tail->ev.vert == 0))
+    || (ev->has_horiz && (ev->horiz == 0 || tail->ev.horiz == 0)))
+    return false;
+  tail->ev.vert += ev->vert;
+  tail->ev.horiz += ev->horiz;
+  return true;
+}
+
+static void queue_input_event_and_relocate_virtual_cursor(
+  struct seat_context *seat, const struct decoded_event *ev,
+  int64_t current_time) {
+  /*
+   * event_time is when the device produced the event. libinput timestamps
+   * come from CLOCK_MONOTONIC, the same clock as current_time_us(). Events
+   * that carry no timestamp, or one that is somehow ahead of us, use the
+   * current time. It feeds the protocol timestamps and the latency stats,
+   * but delays are drawn from current_time: an event read late, or from a
+   * device whose last event is older than another's, still gets a random
+   * delay from now and can't be scheduled ahead of the packets queued
+   * before it.
+   */
+  int64_t event_time = ev->time_us;
+  if (event_time <= 0 || event_time > current_time)
+    event_time = current_time;
+  bool is_motion = ev->type == INPUT_EVENT_MOTION_ABSOLUTE
+    || ev->type == INPUT_EVENT_MOTION;
+
+  if (is_motion) {
+    seat->prev_cursor_x = seat->cursor_x;
+    seat->prev_cursor_y = seat->cursor_y;
+    if (ev->type == INPUT_EVENT_MOTION_ABSOLUTE) {
+      seat->cursor_x = ev->dx * state.global_space_width;
+      seat->cursor_y = ev->dy * state.global_space_height;
+    } else {
+      seat->cursor_x += ev->dx;
+      seat->cursor_y += ev->dy;
+      if (seat->cursor_x < state.pointer_space_x)
+        seat->cursor_x = state.pointer_space_x;
+      if (seat->cursor_y < state.pointer_space_y)
+        seat->cursor_y = state.pointer_space_y;
+      if (seat->cursor_x > state.global_space_width - 1)
+        seat->cursor_x = state.global_space_width - 1;
+      if (seat->cursor_y > state.global_space_height - 1)
+        seat->cursor_y = state.global_space_height - 1;
+    }
+    /*
+     * cursor_x and cursor_y keep the fractional part of relative motion, so
+     * slow movement adds up until it crosses a pixel. Until then there is
+     * nothing to walk, queue or redraw, and the event is dropped before it
+     * is seen by the delay window or the random number generator.
+     */
+    if ((int32_t) seat->cursor_x == (int32_t) seat->prev_cursor_x
+      && (int32_t) seat->cursor_y == (int32_t) seat->prev_cursor_y) {
+      ++metrics.motion_suppressed;
       return;
     }
+  }
 
-  } else if (li_event_type == LIBINPUT_EVENT_POINTER_MOTION) {
-    struct libinput_event_pointer *pointer_event
-      = libinput_event_get_pointer_event(li_event);
-    double rel_x = libinput_event_pointer_get_dx(pointer_event);
-    double rel_y = libinput_event_pointer_get_dy(pointer_event);
-    prev_cursor_x = cursor_x;
-    prev_cursor_y = cursor_y;
-    cursor_x += rel_x;
-    cursor_y += rel_y;
-    if (cursor_x < state.pointer_space_x) cursor_x = state.pointer_space_x;
-    if (cursor_y < state.pointer_space_y) cursor_y = state.pointer_space_y;
-    if (cursor_x > state.global_space_width - 1)
-      cursor_x = state.global_space_width - 1;
-    if (cursor_y > state.global_space_height - 1)
-      cursor_y = state.global_space_height - 1;
-    ev_packet = update_virtual_cursor((uint32_t) current_time);
-    libinput_event_destroy(li_event);
+  /*
+   * Packets leave in the order they were queued, so nothing may be
+   * scheduled before the previous release. The fixed window always reaches
+   * past it, but an adaptive window can be narrower than the queue is
+   * behind. If so the delay is drawn from just the previous release.
+   */
+  int64_t max_delay_us = delay_window_us(seat, ev, event_time);
+  int64_t lower_bound = max(seat->prev_release_time - current_time, 0);
+  int64_t random_delay = random_between(lower_bound,
+    max(max_delay_us, lower_bound));
+  struct input_packet *ev_packet;
+
+  if (is_motion) {
+    int64_t update_start = current_time_ns();
+    ev_packet = update_virtual_cursor(seat, (uint32_t) (event_time / 1000));
+    histogram_record(&metrics.update_cursor_ns,
+      current_time_ns() - update_start);
     if (!ev_packet) {
+      /* update_virtual_cursor() folded the motion into the tail packet. */
+      probe_record(PROBE_COALESCE, seat->idx, ev->type,
+        packet_ring_last(&seat->packet_queue)->id, 0, current_time);
       return;
     }
 
   } else {
-    ev_packet = calloc(1, sizeof(struct input_packet));
-    if (ev_packet == NULL) {
-      fprintf(stderr,
-        "FATAL ERROR: Could not allocate memory for libinput event packet!\n");
-      exit(1);
+    struct input_packet *tail = packet_ring_last(&seat->packet_queue);
+    if (coalesce_scroll_event(tail, ev)) {
+      ++metrics.scroll_coalesced;
+      probe_record(PROBE_COALESCE, seat->idx, ev->type, tail->id, 0,
+        current_time);
+      return;
     }
-    ev_packet->is_libinput = true;
-    ev_packet->li_event = li_event;
-    ev_packet->li_event_type = li_event_type;
+    ev_packet = packet_ring_push(&seat->packet_queue);
+    ev_packet->is_motion = false;
+    ev_packet->ev = *ev;
   }
 
+  ev_packet->event_time = event_time;
   ev_packet->sched_time = current_time + random_delay;
-  TAILQ_INSERT_TAIL(&head, ev_packet, entries);
-  prev_release_time = ev_packet->sched_time;
+  ev_packet->id = next_packet_id++;
+  seat->prev_release_time = ev_packet->sched_time;
+  probe_record(PROBE_ENQUEUE, seat->idx, ev->type, ev_packet->id,
+    random_delay, current_time);
+  histogram_record(&metrics.queue_depth, (int64_t) seat->packet_queue.len);
 }
 
-static void release_scheduled_input_events(void) {
-  int64_t current_time = current_time_ms();
+static void release_scheduled_input_events(struct seat_context *seat,
+  int64_t current_time) {
   struct input_packet *packet;
-  while ((packet = TAILQ_FIRST(&head))
+  size_t released = 0;
+
+  /*
+   * Everything that is due in this tick goes out as one batch: pointer
+   * events share a single frame, and the whole batch is flushed to the
+   * compositor once.
+   */
+  while ((packet = packet_ring_first(&seat->packet_queue))
     && (current_time >= packet->sched_time)) {
-    if (packet->is_libinput) {
-      handle_libinput_event(packet->li_event_type, packet->li_event,
-        (uint32_t) packet->sched_time);
-    } else {
-      zwlr_virtual_pointer_v1_motion_absolute(
-        state.virt_pointer, (uint32_t) packet->sched_time,
-        (uint32_t) packet->cursor_x - state.pointer_space_x,
-        (uint32_t) packet->cursor_y - state.pointer_space_y,
-        state.global_space_width - state.pointer_space_x,
-        state.global_space_height - state.pointer_space_y);
-      zwlr_virtual_pointer_v1_frame(state.virt_pointer);
-    }
-    TAILQ_REMOVE(&head, packet, entries);
-    free(packet);
+    histogram_record(&metrics.input_to_release_us,
+      current_time - packet->event_time);
+    histogram_record(&metrics.release_lateness_us,
+      current_time - packet->sched_time);
+    ++metrics.packets_released;
+    probe_record(PROBE_RELEASE, seat->idx,
+      packet->is_motion ? INPUT_EVENT_MOTION : packet->ev.type, packet->id,
+      current_time - packet->sched_time, current_time);
+    handle_input_packet(seat, packet);
+    packet_ring_pop(&seat->packet_queue);
+    ++released;
   }
+
+  if (released == 0)
+    return;
+  finish_input_batch(seat);
 }
 
 static void print_usage(void) {
@@ -1326,11 +3348,110 @@ static void print_usage(void) {
   fprintf(stderr,
     "  -d, --delay=milliseconds          maximum delay of released events.\n");
   fprintf(stderr,
-    "                                    Default 100.\n");
+    "                                    With --adaptive-delay this is the\n");
+  fprintf(stderr,
+    "                                    latency ceiling. Default 100.\n");
+  fprintf(stderr,
+    "  -a, --adaptive-delay              shrink the delay window while input\n");
+  fprintf(stderr,
+    "                                    arrives quickly or events queue up,\n");
+  fprintf(stderr,
+    "                                    instead of always using --delay.\n");
+  fprintf(stderr,
+    "  -f, --delay-floor=milliseconds    smallest window --adaptive-delay may\n");
+  fprintf(stderr,
+    "                                    use. Default 20.\n");
+  fprintf(stderr,
+    "  -s, --start-delay=milliseconds    longest time to wait at startup for the\n");
+  fprintf(stderr,
+    "                                    compositor's socket, globals and\n");
+  fprintf(stderr,
+    "                                    keymap. Default 500.\n");
+  fprintf(stderr,
+    "  -r, --render-mode=full|cursor     'full' draws the virtual cursor on a\n");
+  fprintf(stderr,
+    "                                    transparent overlay covering each\n");
+  fprintf(stderr,
+    "                                    screen. 'cursor' uses a small overlay\n");
+  fprintf(stderr,
+    "                                    that follows the cursor, which needs\n");
+  fprintf(stderr,
+    "                                    far less memory. Default full.\n");
+  fprintf(stderr,
+    "  -t, --record-trace=file           write every input event and output\n");
+  fprintf(stderr,
+    "                                    layout to a new trace file, for\n");
+  fprintf(stderr,
+    "                                    replay with kloak-bench. The trace\n");
+  fprintf(stderr,
+    "                                    contains everything typed, handle\n");
+  fprintf(stderr,
+    "                                    it like a keylog.\n");
+  fprintf(stderr,
+    "  -P, --probe-log=file              append every event path probe record\n");
+  fprintf(stderr,
+    "                                    (receipt, enqueue, coalescing,\n");
+  fprintf(stderr,
+    "                                    release, frame commit and buffer\n");
+  fprintf(stderr,
+    "                                    release) to a new file. Holds\n");
+  fprintf(stderr,
+    "                                    timings only, no key codes.\n");
+  fprintf(stderr,
+    "  -b, --backend=wayland|uinput      how released input is emitted.\n");
+  fprintf(stderr,
+    "                                    'wayland' uses the compositor's\n");
   fprintf(stderr,
-    "  -s, --start-delay=milliseconds    time to wait before startup. Default 500.\n");
+    "                                    virtual pointer and keyboard\n");
+  fprintf(stderr,
+    "                                    protocols. 'uinput' creates a\n");
+  fprintf(stderr,
+    "                                    /dev/uinput device instead, for\n");
+  fprintf(stderr,
+    "                                    compositors without them. Default\n");
+  fprintf(stderr,
+    "                                    wayland.\n");
+  fprintf(stderr,
+    "  -c, --capture-thread              read input devices on a separate\n");
+  fprintf(stderr,
+    "                                    thread, so that a slow compositor\n");
+  fprintf(stderr,
+    "                                    cannot delay input capture.\n");
+  fprintf(stderr,
+    "  -R, --realtime[=fifo|rr]          lock and prefault memory and release\n");
+  fprintf(stderr,
+    "                                    input with real-time scheduling.\n");
+  fprintf(stderr,
+    "                                    Falls back to normal scheduling if\n");
+  fprintf(stderr,
+    "                                    not permitted. Default fifo.\n");
+  fprintf(stderr,
+    "  -C, --cpu-affinity=cpu[,cpu...]   with --realtime, pin the release loop\n");
+  fprintf(stderr,
+    "                                    to the given CPUs.\n");
+  fprintf(stderr,
+    "  -S, --seat=name                   libinput and Wayland seat to serve.\n");
+  fprintf(stderr,
+    "                                    Repeat for up to 8 seats, each with\n");
+  fprintf(stderr,
+    "                                    its own queue and cursor. Default\n");
+  fprintf(stderr,
+    "                                    seat0 and the first Wayland seat.\n");
+  fprintf(stderr,
+    "  -i, --input-budget=events         most input events taken per seat\n");
+  fprintf(stderr,
+    "                                    before due events are released and\n");
+  fprintf(stderr,
+    "                                    the cursor is redrawn. 0 takes all\n");
+  fprintf(stderr,
+    "                                    pending input. Default 64.\n");
   fprintf(stderr,
     "  -h, --help                        print help\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr,
+    "Send SIGUSR1 to a running kloak to print runtime statistics to stderr,\n");
+  fprintf(stderr,
+    "or SIGUSR2 to print its most recent event path probe records.\n");
 }
 
 /****************************/
@@ -1338,12 +3459,142 @@ static void print_usage(void) {
 /****************************/
 
 static void applayer_random_init(void) {
-  randfd = open("/dev/urandom", O_RDONLY);
-  if (randfd < 0) {
-    fprintf(stderr, "FATAL ERROR: Could not open /dev/urandom: %s\n",
+  csprng_reseed();
+  csprng_refill();
+}
+
+static void applayer_cursor_init(void) {
+  render_crosshair_sprite(&cursor_sprite, CURSOR_RADIUS, CURSOR_COLOR);
+}
+
+static bool wayland_socket_exists(char *path, size_t path_size,
+  const char **name) {
+  const char *display = getenv("WAYLAND_DISPLAY");
+  *name = NULL;
+  if (display == NULL || display[0] == '\0')
+    display = "wayland-0";
+  if (display[0] == '/') {
+    snprintf(path, path_size, "%s", display);
+  } else {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir == NULL)
+      return false;
+    snprintf(path, path_size, "%s/%s", runtime_dir, display);
+  }
+  const char *slash = strrchr(path, '/');
+  *name = slash + 1;
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+static void applayer_wait_for_wayland_socket(void) {
+  char path[PATH_MAX];
+  const char *name;
+
+  /* A socket handed to us by the parent needs no waiting for. */
+  if (getenv("WAYLAND_SOCKET") != NULL)
+    return;
+  if (wayland_socket_exists(path, sizeof(path), &name)) {
+    startup.socket_ready = current_time_us();
+    return;
+  }
+  if (name == NULL)
+    return;
+
+  /* Watch the socket's directory, then check again in case it was created
+   * before the watch was in place. */
+  int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    fprintf(stderr, "FATAL ERROR: Could not create inotify instance: %s\n",
       strerror(errno));
     exit(1);
   }
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%.*s", (int) (name - 1 - path), path);
+  if (inotify_add_watch(inotify_fd, dir[0] ? dir : "/",
+    IN_CREATE | IN_MOVED_TO) < 0) {
+    /* The directory itself is missing; let wl_display_connect report it. */
+    close(inotify_fd);
+    return;
+  }
+
+  struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+  for (;;) {
+    if (wayland_socket_exists(path, sizeof(path), &name)) {
+      startup.socket_ready = current_time_us();
+      break;
+    }
+    int timeout = ms_until(startup.deadline);
+    if (timeout == 0) {
+      startup.timed_out = true;
+      break;
+    }
+    if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+      fprintf(stderr, "FATAL ERROR: Could not poll inotify instance: %s\n",
+        strerror(errno));
+      exit(1);
+    }
+    /* The events themselves don't matter, only that something changed. */
+    char buf[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(inotify_fd, buf, sizeof(buf)) > 0)
+      ;
+  }
+  close(inotify_fd);
+}
+
+static bool wayland_seats_bound(void) {
+  for (size_t i = 0; i < seat_count; ++i) {
+    if (!seats[i].binding)
+      return false;
+  }
+  return true;
+}
+
+static bool wayland_globals_ready(void) {
+  return state.compositor && state.shm && state.layer_shell
+    && state.xdg_output_manager && wayland_seats_bound()
+    && (backend != &wayland_backend
+      || (state.virt_pointer_manager && state.virt_kb_manager));
+}
+
+static bool wayland_keymap_ready(void) {
+  for (size_t i = 0; i < seat_count; ++i) {
+    if (!seats[i].xkb_state)
+      return false;
+  }
+  return true;
+}
+
+static bool wayland_dispatch_until(bool (*ready)(void)) {
+  struct pollfd pfd = { .fd = state.display_fd, .events = POLLIN };
+  while (!ready()) {
+    while (wl_display_prepare_read(state.display) != 0)
+      wl_display_dispatch_pending(state.display);
+    wl_display_flush(state.display);
+    int timeout = ms_until(startup.deadline);
+    if (timeout == 0) {
+      wl_display_cancel_read(state.display);
+      startup.timed_out = true;
+      return false;
+    }
+    int rslt = poll(&pfd, 1, timeout);
+    if (rslt < 0 && errno != EINTR) {
+      fprintf(stderr, "FATAL ERROR: Could not poll Wayland display: %s\n",
+        strerror(errno));
+      exit(1);
+    }
+    if (rslt > 0) {
+      if (wl_display_read_events(state.display) < 0) {
+        fprintf(stderr, "FATAL ERROR: Lost connection to Wayland display!\n");
+        exit(1);
+      }
+    } else {
+      wl_display_cancel_read(state.display);
+    }
+    wl_display_dispatch_pending(state.display);
+  }
+  return true;
 }
 
 static void applayer_wayland_init(void) {
@@ -1364,53 +3615,306 @@ static void applayer_wayland_init(void) {
   }
   wl_registry_add_listener(state.registry, &registry_listener, &state);
   wl_display_roundtrip(state.display);
+  /* Compositors announce their globals in one go, this only waits if some
+   * are still being set up. Whatever is missing at the deadline is reported
+   * below. */
+  wayland_dispatch_until(wayland_globals_ready);
+  if (!state.compositor || !state.shm || !state.layer_shell
+    || !state.xdg_output_manager) {
+    fprintf(stderr,
+      "FATAL ERROR: The compositor is missing a required Wayland protocol!\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < seat_count; ++i) {
+    if (!seats[i].binding) {
+      fprintf(stderr, "FATAL ERROR: The compositor has no seat named %s!\n",
+        seats[i].match_any_wl_seat ? "(any)" : seats[i].name);
+      exit(1);
+    }
+  }
+  startup.globals_ready = current_time_us();
 
   /* At this point, the shm, compositor, and wm_base objects will be
    * allocated by registry global handler. */
 
-  state.virt_kb = zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(
-    state.virt_kb_manager, state.seat);
-  /* The virtual-keyboard-v1 protocol returns 0 when making a new virtual
-   * keyboard if kloak is unauthorized to create a virtual keyboard. However,
-   * the protocol treats this as an enum value, meaning... we have to compare
-   * a pointer to an enum. This is horrible and the protocol really shouldn't
-   * require this, but it does, so... */
-  if ((uint64_t)state.virt_kb
-    == ZWP_VIRTUAL_KEYBOARD_MANAGER_V1_ERROR_UNAUTHORIZED) {
-    fprintf(stderr,
-      "Not authorized to create a virtual keyboard! Bailing out.\n");
-    exit(1);
+  if (backend == &wayland_backend) {
+    if (!state.virt_pointer_manager || !state.virt_kb_manager) {
+      fprintf(stderr,
+        "FATAL ERROR: The compositor does not support the virtual pointer and keyboard protocols! Try --backend=uinput.\n");
+      exit(1);
+    }
+    for (size_t i = 0; i < seat_count; ++i) {
+      struct seat_context *seat = &seats[i];
+      seat->virt_pointer
+        = zwlr_virtual_pointer_manager_v1_create_virtual_pointer(
+        state.virt_pointer_manager, seat->binding->seat);
+      seat->virt_kb = zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(
+        state.virt_kb_manager, seat->binding->seat);
+      /* The virtual-keyboard-v1 protocol returns 0 when making a new virtual
+       * keyboard if kloak is unauthorized to create a virtual keyboard.
+       * However, the protocol treats this as an enum value, meaning... we
+       * have to compare a pointer to an enum. This is horrible and the
+       * protocol really shouldn't require this, but it does, so... */
+      if ((uint64_t)seat->virt_kb
+        == ZWP_VIRTUAL_KEYBOARD_MANAGER_V1_ERROR_UNAUTHORIZED) {
+        fprintf(stderr,
+          "Not authorized to create a virtual keyboard! Bailing out.\n");
+        exit(1);
+      }
+    }
   }
-  wl_seat_add_listener(state.seat, &seat_listener, &state);
 
   state.xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
   if (!state.xkb_ctx) {
     fprintf(stderr, "FATAL ERROR: Could not create XKB context!\n");
     exit(1);
   }
+  for (size_t i = 0; i < seat_count; ++i)
+    seat_binding_update_keyboard(seats[i].binding);
+
+  /* Until the keymap arrives, key events can't be forwarded. */
+  if (wayland_dispatch_until(wayland_keymap_ready)) {
+    startup.keymap_ready = current_time_us();
+  } else {
+    fprintf(stderr,
+      "WARNING: No keymap received within --start-delay, continuing without one.\n");
+  }
+}
+
+static void applayer_uinput_init(void) {
+  uinput_device.fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+  if (uinput_device.fd < 0) {
+    fprintf(stderr, "FATAL ERROR: Could not open /dev/uinput: %s\n",
+      strerror(errno));
+    exit(1);
+  }
+
+  /*
+   * An absolute pointer with mouse buttons, a wheel and a keyboard. Joystick,
+   * tablet and touch codes are left out so that the device is not mistaken
+   * for one of those.
+   */
+  int fd = uinput_device.fd;
+  bool ok = ioctl(fd, UI_SET_EVBIT, EV_SYN) >= 0
+    && ioctl(fd, UI_SET_EVBIT, EV_KEY) >= 0
+    && ioctl(fd, UI_SET_EVBIT, EV_REL) >= 0
+    && ioctl(fd, UI_SET_EVBIT, EV_ABS) >= 0
+    && ioctl(fd, UI_SET_RELBIT, REL_WHEEL) >= 0
+    && ioctl(fd, UI_SET_RELBIT, REL_HWHEEL) >= 0
+    && ioctl(fd, UI_SET_RELBIT, REL_WHEEL_HI_RES) >= 0
+    && ioctl(fd, UI_SET_RELBIT, REL_HWHEEL_HI_RES) >= 0;
+  for (int code = KEY_ESC; ok && code < BTN_MISC; ++code)
+    ok = ioctl(fd, UI_SET_KEYBIT, code) >= 0;
+  for (int code = BTN_LEFT; ok && code <= BTN_TASK; ++code)
+    ok = ioctl(fd, UI_SET_KEYBIT, code) >= 0;
+  for (int code = KEY_OK; ok && code < BTN_DPAD_UP; ++code)
+    ok = ioctl(fd, UI_SET_KEYBIT, code) >= 0;
+  for (int code = ABS_X; ok && code <= ABS_Y; ++code) {
+    struct uinput_abs_setup abs_setup = {
+      .code = (uint16_t) code,
+      .absinfo = { .minimum = 0, .maximum = UINPUT_ABS_MAX },
+    };
+    ok = ioctl(fd, UI_SET_ABSBIT, code) >= 0
+      && ioctl(fd, UI_ABS_SETUP, &abs_setup) >= 0;
+  }
+  struct uinput_setup setup = {
+    .id = { .bustype = BUS_VIRTUAL },
+  };
+  strncpy(setup.name, UINPUT_NAME, sizeof(setup.name) - 1);
+  ok = ok && ioctl(fd, UI_SET_PHYS, UINPUT_PHYS) >= 0
+    && ioctl(fd, UI_DEV_SETUP, &setup) >= 0
+    && ioctl(fd, UI_DEV_CREATE) >= 0;
+  if (!ok) {
+    fprintf(stderr, "FATAL ERROR: Could not create uinput device: %s\n",
+      strerror(errno));
+    exit(1);
+  }
 }
 
 static void applayer_libinput_init(void) {
   udev_ctx = udev_new();
-  li = libinput_udev_create_context(&li_interface, NULL, udev_ctx);
-  /* TODO: Allow customizing the seat with a command line arg */
-  libinput_udev_assign_seat(li, "seat0");
-  TAILQ_INIT(&head);
+  for (size_t i = 0; i < seat_count; ++i) {
+    struct seat_context *seat = &seats[i];
+    seat->li = libinput_udev_create_context(&li_interface, NULL, udev_ctx);
+    if (!seat->li || libinput_udev_assign_seat(seat->li, seat->name) != 0) {
+      fprintf(stderr, "FATAL ERROR: Could not assign libinput seat %s!\n",
+        seat->name);
+      exit(1);
+    }
+    packet_ring_init(&seat->packet_queue, PACKET_RING_INITIAL_CAPACITY);
+    seat->adaptive_delay = adaptive_delay;
+    seat->capture_event_fd = -1;
+  }
 }
 
 static void applayer_poll_init(void) {
-  ev_fds = calloc(2, sizeof(struct pollfd));
-  ev_fds[0].fd = state.display_fd;
-  ev_fds[0].events = POLLIN;
-  ev_fds[1].fd = libinput_get_fd(li);
-  ev_fds[1].events = POLLIN;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    fprintf(stderr, "FATAL ERROR: Could not create epoll instance: %s\n",
+      strerror(errno));
+    exit(1);
+  }
+
+  release_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+    TFD_NONBLOCK | TFD_CLOEXEC);
+  if (release_timer_fd < 0) {
+    fprintf(stderr, "FATAL ERROR: Could not create release timer: %s\n",
+      strerror(errno));
+    exit(1);
+  }
+
+  /* SIGUSR1 and SIGUSR2 are delivered through a signalfd so that stats and
+   * the probe ring can be dumped from the main loop rather than from inside
+   * a signal handler. */
+  sigset_t sigmask;
+  sigemptyset(&sigmask);
+  sigaddset(&sigmask, SIGUSR1);
+  sigaddset(&sigmask, SIGUSR2);
+  if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
+    fprintf(stderr, "FATAL ERROR: Could not block SIGUSR1 and SIGUSR2: %s\n",
+      strerror(errno));
+    exit(1);
+  }
+  signal_fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd < 0) {
+    fprintf(stderr, "FATAL ERROR: Could not create signalfd: %s\n",
+      strerror(errno));
+    exit(1);
+  }
+
+  add_epoll_fd(state.display_fd, EPOLL_SRC_WAYLAND);
+  /* With --capture-thread, libinput belongs to the capture threads. */
+  if (!threaded_capture) {
+    for (size_t i = 0; i < seat_count; ++i)
+      add_epoll_fd(libinput_get_fd(seats[i].li), EPOLL_SRC_LIBINPUT);
+  }
+  add_epoll_fd(release_timer_fd, EPOLL_SRC_TIMER);
+  add_epoll_fd(signal_fd, EPOLL_SRC_SIGNAL);
+}
+
+static void applayer_capture_init(void) {
+  for (size_t i = 0; i < seat_count; ++i) {
+    struct seat_context *seat = &seats[i];
+    seat->capture_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (seat->capture_event_fd < 0) {
+      fprintf(stderr, "FATAL ERROR: Could not create capture eventfd: %s\n",
+        strerror(errno));
+      exit(1);
+    }
+    capture_ring_init(&seat->capture_ring, CAPTURE_RING_CAPACITY);
+    add_epoll_fd(seat->capture_event_fd, EPOLL_SRC_CAPTURE);
+
+    /* The thread inherits our signal mask, which by now blocks SIGUSR1 and
+     * SIGUSR2. */
+    int err = pthread_create(&seat->capture_thread, NULL, capture_thread_main,
+      seat);
+    if (err != 0) {
+      fprintf(stderr, "FATAL ERROR: Could not start capture thread: %s\n",
+        strerror(err));
+      exit(1);
+    }
+  }
+}
+
+static void applayer_realtime_init(void) {
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+    realtime.memory_locked = true;
+  } else {
+    fprintf(stderr, "WARNING: Could not lock memory: %s\n", strerror(errno));
+  }
+
+  /*
+   * Give the packet queue enough room that it never has to grow while
+   * releasing input, and touch everything the release path writes to
+   * beforehand. Layer pools are prefaulted as they are mapped.
+   */
+  for (size_t i = 0; i < seat_count; ++i) {
+    struct packet_ring *queue = &seats[i].packet_queue;
+    struct capture_ring *ring = &seats[i].capture_ring;
+    while (queue->capacity < REALTIME_PACKET_RING_CAPACITY)
+      packet_ring_grow(queue);
+    realtime.prefaulted_bytes += prefault_memory(queue->packets,
+      queue->capacity * sizeof(struct input_packet));
+    realtime.prefaulted_bytes += prefault_memory(ring->entries,
+      ring->capacity * sizeof(struct capture_entry));
+  }
+  prefault_stack();
+  realtime.prefaulted_bytes += REALTIME_STACK_PREFAULT_BYTES;
+
+  if (realtime.have_affinity) {
+    if (sched_setaffinity(0, sizeof(realtime.cpus), &realtime.cpus) == 0) {
+      realtime.affinity_set = true;
+    } else {
+      fprintf(stderr, "WARNING: Could not set CPU affinity: %s\n",
+        strerror(errno));
+    }
+  }
+
+  /* Only this thread, which releases events, becomes real-time. Capture
+   * threads were already started and keep the default policy. */
+  struct sched_param param = { .sched_priority = REALTIME_PRIORITY };
+  if (sched_setscheduler(0, realtime.policy, &param) != 0) {
+    fprintf(stderr,
+      "WARNING: Could not switch to real-time scheduling: %s\n",
+      strerror(errno));
+  }
+  realtime.achieved_policy = sched_getscheduler(0);
+  if (sched_getparam(0, &param) == 0)
+    realtime.achieved_priority = param.sched_priority;
+}
+
+static void applayer_notify_ready(void) {
+  startup.ready = current_time_us();
+
+  /* The sd_notify() protocol: one datagram to $NOTIFY_SOCKET. A leading '@'
+   * names a socket in the abstract namespace. */
+  const char *socket_path = getenv("NOTIFY_SOCKET");
+  if (socket_path == NULL || socket_path[0] == '\0')
+    return;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  size_t path_len = strlen(socket_path);
+  if (path_len >= sizeof(addr.sun_path)
+    || (socket_path[0] != '/' && socket_path[0] != '@')) {
+    fprintf(stderr, "WARNING: Ignoring invalid NOTIFY_SOCKET '%s'.\n",
+      socket_path);
+    return;
+  }
+  memcpy(addr.sun_path, socket_path, path_len);
+  if (addr.sun_path[0] == '@')
+    addr.sun_path[0] = '\0';
+
+  char msg[128];
+  int msg_len = snprintf(msg, sizeof(msg),
+    "READY=1\nSTATUS=Protecting input, ready after %" PRId64 " ms\n",
+    (startup.ready - startup.start) / 1000);
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || sendto(fd, msg, (size_t) msg_len, MSG_NOSIGNAL,
+    (struct sockaddr *) &addr,
+    (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path_len)) < 0) {
+    fprintf(stderr, "WARNING: Could not notify service manager: %s\n",
+      strerror(errno));
+  }
+  if (fd >= 0)
+    close(fd);
 }
 
 static void parse_cli_args(int argc, char **argv) {
-  const char *optstring = "d:s:h";
+  const char *optstring = "d:af:s:r:t:P:b:cR::C:S:i:h";
+  int32_t delay_floor = DEFAULT_DELAY_FLOOR_MS;
   static struct option optarr[] = {
     {"delay", required_argument, NULL, 'd'},
+    {"adaptive-delay", no_argument, NULL, 'a'},
+    {"delay-floor", required_argument, NULL, 'f'},
     {"start-delay", required_argument, NULL, 's'},
+    {"render-mode", required_argument, NULL, 'r'},
+    {"record-trace", required_argument, NULL, 't'},
+    {"probe-log", required_argument, NULL, 'P'},
+    {"backend", required_argument, NULL, 'b'},
+    {"capture-thread", no_argument, NULL, 'c'},
+    {"realtime", optional_argument, NULL, 'R'},
+    {"cpu-affinity", required_argument, NULL, 'C'},
+    {"seat", required_argument, NULL, 'S'},
+    {"input-budget", required_argument, NULL, 'i'},
     {"help", no_argument, NULL, 'h'},
     {0, 0, 0, 0}
   };
@@ -1424,8 +3928,59 @@ static void parse_cli_args(int argc, char **argv) {
       exit(1);
     } else if (getopt_rslt == 'd') {
       max_delay = parse_uintarg("delay", optarg);
+    } else if (getopt_rslt == 'a') {
+      adaptive_delay.enabled = true;
+    } else if (getopt_rslt == 'f') {
+      delay_floor = parse_uintarg("delay-floor", optarg);
     } else if (getopt_rslt == 's') {
       startup_delay = parse_uintarg("start-delay", optarg);
+    } else if (getopt_rslt == 'r') {
+      if (strcmp(optarg, "full") == 0) {
+        render_mode = RENDER_MODE_FULL;
+      } else if (strcmp(optarg, "cursor") == 0) {
+        render_mode = RENDER_MODE_CURSOR;
+      } else {
+        fprintf(stderr,
+          "FATAL ERROR: Invalid value '%s' passed to parameter 'render-mode'!\n",
+          optarg);
+        exit(1);
+      }
+    } else if (getopt_rslt == 't') {
+      trace_open_writer(optarg);
+    } else if (getopt_rslt == 'P') {
+      probe_open_log(optarg);
+    } else if (getopt_rslt == 'b') {
+      if (strcmp(optarg, "wayland") == 0) {
+        backend = &wayland_backend;
+      } else if (strcmp(optarg, "uinput") == 0) {
+        backend = &uinput_backend;
+      } else {
+        fprintf(stderr,
+          "FATAL ERROR: Invalid value '%s' passed to parameter 'backend'!\n",
+          optarg);
+        exit(1);
+      }
+    } else if (getopt_rslt == 'c') {
+      threaded_capture = true;
+    } else if (getopt_rslt == 'R') {
+      realtime.enabled = true;
+      if (optarg == NULL || strcmp(optarg, "fifo") == 0) {
+        realtime.policy = SCHED_FIFO;
+      } else if (strcmp(optarg, "rr") == 0) {
+        realtime.policy = SCHED_RR;
+      } else {
+        fprintf(stderr,
+          "FATAL ERROR: Invalid value '%s' passed to parameter 'realtime'!\n",
+          optarg);
+        exit(1);
+      }
+    } else if (getopt_rslt == 'C') {
+      parse_cpu_list(optarg, &realtime.cpus);
+      realtime.have_affinity = true;
+    } else if (getopt_rslt == 'S') {
+      add_seat(optarg);
+    } else if (getopt_rslt == 'i') {
+      input_budget = (size_t) parse_uintarg("input-budget", optarg);
     } else if (getopt_rslt == 'h') {
       print_usage();
       exit(0);
@@ -1434,6 +3989,25 @@ static void parse_cli_args(int argc, char **argv) {
       exit(1);
     }
   }
+
+  /* A floor above the ceiling just means a fixed window at the ceiling. */
+  adaptive_delay.floor_us = (int64_t) min(delay_floor, max_delay) * 1000;
+
+  if (seat_count == 0) {
+    add_seat(DEFAULT_SEAT);
+    seats[0].match_any_wl_seat = true;
+  }
+  /* One uinput device and one cursor-sized overlay can't serve two seats. */
+  if (seat_count > 1 && backend == &uinput_backend) {
+    fprintf(stderr,
+      "FATAL ERROR: --backend=uinput supports only a single --seat!\n");
+    exit(1);
+  }
+  if (seat_count > 1 && render_mode == RENDER_MODE_CURSOR) {
+    fprintf(stderr,
+      "FATAL ERROR: --render-mode=cursor supports only a single --seat!\n");
+    exit(1);
+  }
 }
 
 /**********/
@@ -1442,59 +4016,148 @@ static void parse_cli_args(int argc, char **argv) {
 /**********/
 /**********/
 
+#ifndef KLOAK_BENCH
+
 int main(int argc, char **argv) {
   if (getuid() != 0) {
     fprintf(stderr, "FATAL ERROR: Must be run as root!\n");
     exit(1);
   }
+  startup.start = current_time_us();
   parse_cli_args(argc, argv);
-  sleep_ms(startup_delay);
+  startup.deadline = startup.start + (int64_t) startup_delay * 1000;
+  applayer_wait_for_wayland_socket();
 
   applayer_random_init();
+  applayer_cursor_init();
   applayer_wayland_init();
+  if (backend == &uinput_backend)
+    applayer_uinput_init();
   applayer_libinput_init();
   applayer_poll_init();
+  if (threaded_capture)
+    applayer_capture_init();
+  if (realtime.enabled)
+    applayer_realtime_init();
+  applayer_notify_ready();
 
   for (;;) {
     while (wl_display_prepare_read(state.display) != 0)
       wl_display_dispatch_pending(state.display);
     wl_display_flush(state.display);
 
-    for (;;) {
-      enum libinput_event_type next_ev_type = libinput_next_event_type(li);
-      if (next_ev_type == LIBINPUT_EVENT_NONE)
-        break;
-      struct libinput_event *li_event = libinput_get_event(li);
-      queue_libinput_event_and_relocate_virtual_cursor(next_ev_type,
-        li_event);
+    /* Apply any output changes from the events dispatched so far at once. */
+    recalc_global_space(&state);
+
+    /*
+     * Packets that are already due go out before any more input is taken,
+     * and each seat yields at most input_budget events per iteration, so
+     * that a burst of input can't hold up releases and redraws. Leftover
+     * input is picked up by the next iteration, which doesn't block.
+     */
+    int64_t release_time = current_time_us();
+    for (size_t i = 0; i < seat_count; ++i)
+      release_scheduled_input_events(&seats[i], release_time);
+    bool input_pending = false;
+    for (size_t i = 0; i < seat_count; ++i) {
+      struct seat_context *seat = &seats[i];
+      if (threaded_capture) {
+        input_pending |= drain_capture_ring(seat, input_budget);
+      } else {
+        input_pending |= drain_libinput_events(seat, input_budget);
+      }
     }
-
-    release_scheduled_input_events();
-
-    for (size_t i = 0; i < MAX_DRAWABLE_LAYERS; ++i) {
-      if (!state.layers[i])
-        continue;
-      if (state.layers[i]->frame_pending)
-        draw_frame(state.layers[i]);
+    if (input_pending)
+      ++metrics.input_budget_hits;
+    release_time = current_time_us();
+    for (size_t i = 0; i < seat_count; ++i)
+      release_scheduled_input_events(&seats[i], release_time);
+
+    /*
+     * Only layers on the dirty list need drawing. A layer stays on the list
+     * if draw_frame could not submit it yet (not configured, a frame
+     * callback outstanding, or no free buffer).
+     */
+    size_t dirty_kept = 0;
+    for (size_t i = 0; i < state.dirty_count; ++i) {
+      struct drawable_layer *layer = state.dirty_layers[i];
+      if (layer->frame_pending)
+        backend->draw_layer(layer);
+      if (layer->frame_pending) {
+        state.dirty_layers[dirty_kept++] = layer;
+      } else {
+        layer->dirty_listed = false;
+      }
     }
+    state.dirty_count = dirty_kept;
     wl_display_flush(state.display);
+    trace_flush();
+
+    /*
+     * Sleep until either an fd becomes readable or the next queued packet is
+     * due. With an empty queue the release timer is disarmed and we block
+     * indefinitely. If input was left over by the budget we only poll.
+     */
+    arm_release_timer();
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS,
+      input_pending ? 0 : -1);
+    if (nfds < 0 && errno != EINTR) {
+      fprintf(stderr, "FATAL ERROR: epoll_wait failed: %s\n",
+        strerror(errno));
+      exit(1);
+    }
+    ++loop_wakeups;
+
+    bool wayland_readable = false;
+    bool libinput_readable = false;
+    for (int i = 0; i < nfds; ++i) {
+      switch (events[i].data.u32) {
+        case EPOLL_SRC_WAYLAND:
+          wayland_readable = true;
+          break;
+        case EPOLL_SRC_LIBINPUT:
+          libinput_readable = true;
+          break;
+        case EPOLL_SRC_CAPTURE:
+          /* Drained at the top of the loop. */
+          break;
+        case EPOLL_SRC_TIMER: {
+          uint64_t expirations;
+          if (read(release_timer_fd, &expirations, sizeof(expirations)) > 0)
+            ++timer_wakeups;
+          armed_release_deadline = -1;
+          break;
+        }
+        case EPOLL_SRC_SIGNAL: {
+          struct signalfd_siginfo siginfo;
+          while (read(signal_fd, &siginfo, sizeof(siginfo)) > 0) {
+            if (siginfo.ssi_signo == SIGUSR1)
+              dump_stats();
+            else if (siginfo.ssi_signo == SIGUSR2)
+              probe_dump();
+          }
+          break;
+        }
+      }
+    }
 
-    poll(ev_fds, 2, POLL_TIMEOUT_MS);
-
-    if (ev_fds[0].revents & POLLIN) {
+    if (wayland_readable) {
       wl_display_read_events(state.display);
       wl_display_dispatch_pending(state.display);
     } else {
       wl_display_cancel_read(state.display);
     }
-    ev_fds[0].revents = 0;
 
-    if (ev_fds[1].revents & POLLIN) {
-      libinput_dispatch(li);
+    if (libinput_readable) {
+      /* The event doesn't say which seat's fd woke us, dispatching an idle
+       * context is cheap. */
+      for (size_t i = 0; i < seat_count; ++i)
+        libinput_dispatch(seats[i].li);
     }
-    ev_fds[1].revents = 0;
   }
 
   wl_display_disconnect(state.display);
   return 0;
 }
+#endif /* KLOAK_BENCH */
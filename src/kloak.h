@@ -7,11 +7,51 @@
 #include <wayland-client.h>
 #include <libinput.h>
 
-#define MAX_DRAWABLE_LAYERS 128
+#define INITIAL_LAYER_CAPACITY 4
 #define CURSOR_RADIUS 15
-#define POLL_TIMEOUT_MS 1
+#define CURSOR_COLOR 0xffff0000
+#define LAYER_BUFFER_COUNT 2
+#define CURSOR_SURFACE_SIZE (CURSOR_RADIUS * 2 + 1)
+#define MAX_DAMAGE_RECTS 4
+#define MAX_EPOLL_EVENTS 8
 #define DEFAULT_MAX_DELAY_MS 100
 #define DEFAULT_STARTUP_TIMEOUT_MS 500
+#define DEFAULT_DELAY_FLOOR_MS 20
+#define DEFAULT_INPUT_BUDGET 64
+#define ADAPTIVE_GAP_EWMA_WEIGHT 8
+#define ADAPTIVE_QUEUE_DEPTH_TARGET 8
+#define CHACHA20_KEY_SIZE 32
+#define CHACHA20_NONCE_SIZE 8
+#define CSPRNG_BUF_SIZE 1024
+#define CSPRNG_RESEED_BYTES (1024 * 1024)
+#define PACKET_RING_INITIAL_CAPACITY 256
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((size_t) 32 * HISTOGRAM_SUB_BUCKETS)
+#define TRACE_MAGIC "KLKTRACE"
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 12
+#define TRACE_RECORD_SIZE 24
+#define TRACE_FIXED_ONE 256.0
+#define TRACE_ABS_ONE 16777216.0
+#define PROBE_MAGIC "KLKPROBE"
+#define PROBE_VERSION 1
+#define PROBE_HEADER_SIZE 12
+#define PROBE_RECORD_SIZE 20
+#define PROBE_RING_SIZE 4096
+#define UINPUT_NAME "kloak virtual input"
+#define UINPUT_PHYS "kloak/uinput"
+#define UINPUT_ABS_MAX 65535
+#define UINPUT_BUF_EVENTS 64
+#define CAPTURE_RING_CAPACITY 4096
+#define KEYMAP_CACHE_SIZE 4
+#define MAX_SEATS 8
+#define MAX_WAYLAND_SEATS 16
+#define DEFAULT_SEAT "seat0"
+#define REALTIME_PRIORITY 10
+#define REALTIME_PACKET_RING_CAPACITY 8192
+#define REALTIME_STACK_PREFAULT_BYTES (64 * 1024)
 
 #ifndef min
 #define min(a, b) ( ((a) < (b)) ? (a) : (b) )
@@ -25,40 +65,158 @@
 /* core structures */
 /*******************/
 
+/*
+ * How the virtual cursor is drawn. RENDER_MODE_FULL covers each output with a
+ * transparent layer the size of the output. RENDER_MODE_CURSOR gives each
+ * output a CURSOR_SURFACE_SIZE square layer that is moved to follow the
+ * cursor with layer-shell margins.
+ */
+enum render_mode {
+  RENDER_MODE_FULL,
+  RENDER_MODE_CURSOR,
+};
+
+/*
+ * One of the persistent buffers belonging to a drawable_layer. drawn_cursor_x
+ * and drawn_cursor_y record where each seat's cursor was last drawn into
+ * this particular buffer (or -1 if it wasn't), so that it can be erased the
+ * next time the buffer is reused.
+ */
+struct layer_buffer {
+  struct drawable_layer *layer;
+  struct wl_buffer *buffer;
+  uint32_t *pixbuf;
+  bool busy;
+  int32_t drawn_cursor_x[MAX_SEATS];
+  int32_t drawn_cursor_y[MAX_SEATS];
+};
+
+/*
+ * Defines the location and size of a display in compositor-global space.
+ */
+struct output_geometry {
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+};
+
+/*
+ * A damaged region of a layer, in buffer coordinates.
+ */
+struct damage_rect {
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+};
+
+/*
+ * The regions of a layer that changed in the frame currently being drawn.
+ */
+struct damage_tracker {
+  struct damage_rect rects[MAX_DAMAGE_RECTS];
+  size_t len;
+};
+
 /*
  * Defines a screen-local layer that can be drawn on. Each screen has one
  * drawable layer, the virtual cursor is drawn on this. The layer will be
  * created using layer_shell and will appear on top of all other surfaces if
- * at all possible.
+ * at all possible. Each layer owns LAYER_BUFFER_COUNT buffers allocated from
+ * a single shm pool, and rotates through them so that a new frame can be
+ * drawn while the compositor still holds the previous one.
+ *
+ * Layers also own the per-output state, so that every Wayland object tied to
+ * an output can carry its layer as listener data.
  */
+struct disp_state;
 struct drawable_layer {
+  struct disp_state *state;
+  /* Position in disp_state.layers, kept up to date on removal */
+  size_t idx;
+  uint32_t output_name;
   struct wl_output *output;
-  struct wl_buffer *buffer;
+  struct zxdg_output_v1 *xdg_output;
+  struct output_geometry geometry;
+  struct output_geometry pending_geometry;
+  bool geometry_valid;
+  /* Whether this layer is part of the output_topology forest */
+  bool topology_joined;
+  struct layer_buffer buffers[LAYER_BUFFER_COUNT];
   size_t width;
   size_t height;
   size_t stride;
   size_t size;
-  uint32_t *pixbuf;
+  uint32_t *pool_data;
+  size_t pool_size;
   struct wl_surface *surface;
   struct wl_shm_pool *shm_pool;
   /* Layer shell stuff */
   struct zwlr_layer_surface_v1 *layer_surface;
   bool layer_surface_configured;
-  /* Sync state */
-  bool frame_released;
+  /* Position of the surface in screen-local space, only ever nonzero when
+   * the layer is cursor-sized */
+  bool cursor_sized;
+  int32_t origin_x;
+  int32_t origin_y;
+  /* Sync state, cursor position is buffer-local */
+  struct damage_tracker damage;
   bool frame_pending;
-  int32_t last_drawn_cursor_x;
-  int32_t last_drawn_cursor_y;
+  bool frame_deferred;
+  bool dirty_listed;
+  struct wl_callback *frame_callback;
+  int32_t last_drawn_cursor_x[MAX_SEATS];
+  int32_t last_drawn_cursor_y[MAX_SEATS];
+  /* Statistics */
+  int32_t refresh_mhz;
+  uint64_t frames_committed;
+  uint64_t frames_presented;
+  uint64_t frames_skipped;
+  uint64_t updates_coalesced;
+  uint64_t damaged_pixels;
+  int64_t last_frame_damaged_pixels;
 };
 
 /*
- * Defines the location and size of a display in compositor-global space.
+ * One active output in the output_index. x_end and y_end are exclusive.
  */
-struct output_geometry {
+struct output_index_entry {
   int32_t x;
   int32_t y;
-  int32_t width;
-  int32_t height;
+  int32_t x_end;
+  int32_t y_end;
+  int32_t output_idx;
+};
+
+/*
+ * Lookup structure for finding which output covers a point in compositor
+ * global space. Holds the active outputs densely, sorted by x, so that a
+ * binary search plus a short backwards scan finds the candidates. last_hit
+ * caches the entry that satisfied the most recent lookup.
+ */
+struct output_index {
+  struct output_index_entry *entries;
+  size_t capacity;
+  size_t len;
+  size_t last_hit;
+  int32_t max_width;
+  bool has_overlaps;
+};
+
+/*
+ * Connectivity of the active outputs, as a union-find forest over layer
+ * indices. Outputs that gain a geometry are joined incrementally. An output
+ * that moves or disappears may have been the only link between two others,
+ * so that sets needs_rebuild and the forest is regrown from scratch.
+ */
+struct output_topology {
+  size_t *parent;
+  size_t *rank;
+  size_t capacity;
+  size_t components;
+  bool dirty;
+  bool needs_rebuild;
 };
 
 /*
@@ -80,28 +238,344 @@ struct coord {
   int32_t y;
 };
 
+/*
+ * Walks a line between two points one pixel at a time using only integer
+ * arithmetic. At position pos the point is pos pixels from the start along
+ * the major axis and floor(pos * minor / major) pixels along the minor axis.
+ * err holds pos * minor % major, so each step costs an add and a compare.
+ */
+struct line_iter {
+  struct coord start;
+  struct coord cur;
+  int32_t step_x;
+  int32_t step_y;
+  bool x_major;
+  int32_t major;
+  int32_t minor;
+  int32_t pos;
+  int32_t minor_off;
+  int32_t err;
+};
+
+/*
+ * A pre-rendered, square image of the virtual cursor, size pixels on a side
+ * with the hotspot in the center. Drawing the cursor is a row-by-row copy of
+ * this.
+ */
+struct cursor_sprite {
+  uint32_t *pixels;
+  int32_t size;
+  int32_t rad;
+};
+
+/*
+ * The part of a square block that falls inside a layer. All bounds are
+ * inclusive.
+ */
+struct block_clip {
+  int32_t start_x;
+  int32_t start_y;
+  int32_t end_x;
+  int32_t end_y;
+};
+
+/*
+ * State for --adaptive-delay. The delay window follows an exponentially
+ * weighted moving average of the gap between discrete input events, scaled
+ * down when the queue is deep, and clamped to [floor_us, max_delay].
+ */
+struct adaptive_delay {
+  bool enabled;
+  int64_t floor_us;
+  int64_t last_arrival;
+  int64_t gap_ewma_us;
+  int64_t window_us;
+  uint64_t shrunk_events;
+};
+
+/*
+ * A log-linear histogram in the style of HdrHistogram. Values below
+ * HISTOGRAM_SUB_BUCKETS get a bucket each, and every power of two above that
+ * is split into HISTOGRAM_SUB_BUCKETS buckets, which bounds the relative
+ * error of a reported percentile to about 3%. Recording is a handful of
+ * integer operations and never allocates.
+ */
+struct histogram {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+};
+
+/*
+ * Always-on runtime metrics, dumped along with the other statistics on
+ * SIGUSR1.
+ */
+struct metrics {
+  /* Device timestamp to release, and release to scheduled release time */
+  struct histogram input_to_release_us;
+  struct histogram release_lateness_us;
+  /* Queue length right after each packet is scheduled */
+  struct histogram queue_depth;
+  struct histogram update_cursor_ns;
+  uint64_t packets_released;
+  /* Motion events folded into an already queued motion packet */
+  uint64_t motion_coalesced;
+  /* Motion events that left the cursor on the same pixel */
+  uint64_t motion_suppressed;
+  /* Finger and continuous scroll events folded into a queued scroll packet */
+  uint64_t scroll_coalesced;
+  /* Keymap changes served from, or added to, the keymap cache */
+  uint64_t keymap_cache_hits;
+  uint64_t keymap_cache_misses;
+  /* Loop iterations that left input behind after --input-budget events */
+  uint64_t input_budget_hits;
+};
+
+/*
+ * Record types in an input trace.
+ */
+enum trace_record_type {
+  TRACE_RECORD_IDLE,
+  TRACE_RECORD_OUTPUT,
+  TRACE_RECORD_MOTION,
+  TRACE_RECORD_MOTION_ABSOLUTE,
+  TRACE_RECORD_BUTTON,
+  TRACE_RECORD_SCROLL,
+  TRACE_RECORD_KEY,
+};
+
+/*
+ * One record of an input trace. A trace file is a TRACE_HEADER_SIZE byte
+ * header (TRACE_MAGIC followed by a little-endian uint32 TRACE_VERSION) and
+ * a sequence of TRACE_RECORD_SIZE byte records, each laid out as:
+ *
+ *   uint8  type
+ *   uint8  arg
+ *   uint16 reserved, zero
+ *   uint32 time_delta_us, since the previous record
+ *   int32  a, b, c, d
+ *
+ * all little-endian. The meaning of arg and a..d depends on the type:
+ *
+ *   IDLE             time passes, nothing else (for gaps over UINT32_MAX us)
+ *   OUTPUT           a, b, c, d = x, y, width, height; arg bit 0 starts a
+ *                    new layout, replacing every output seen before
+ *   MOTION           a, b = dx, dy in units of 1/TRACE_FIXED_ONE pixel
+ *   MOTION_ABSOLUTE  a, b = x, y in units of 1/TRACE_ABS_ONE of the layout
+ *   BUTTON, KEY      a = evdev code, arg = 1 if pressed
+ *   SCROLL           a, b = vertical, horizontal in 1/TRACE_FIXED_ONE units,
+ *                    arg bits 0-1 = scroll_source, bit 2 = has vertical,
+ *                    bit 3 = has horizontal
+ */
+struct trace_record {
+  enum trace_record_type type;
+  uint8_t arg;
+  uint32_t time_delta_us;
+  int32_t a;
+  int32_t b;
+  int32_t c;
+  int32_t d;
+};
+
+/*
+ * State for --record-trace.
+ */
+struct trace_writer {
+  FILE *file;
+  int64_t last_time_us;
+  bool dirty;
+};
+
+/*
+ * Points on the event path that write a probe record.
+ */
+enum probe_point {
+  PROBE_RECEIVE,
+  PROBE_ENQUEUE,
+  PROBE_COALESCE,
+  PROBE_RELEASE,
+  PROBE_COMMIT,
+  PROBE_BUFFER_RELEASE,
+};
+
+/*
+ * One probe record. Input points carry the seat index in index, the
+ * input_event_type in kind and the packet id in id (0 on receipt, before
+ * there is a packet); value is, per point:
+ *
+ *   RECEIVE         microseconds from the device timestamp to receipt
+ *   ENQUEUE         microseconds of delay the new packet was given
+ *   COALESCE        0, id is the queued packet the event was folded into
+ *   RELEASE         microseconds the packet was released past its deadline
+ *
+ * Frame points carry the layer index in index: COMMIT has the layer's
+ * frame count in id and the damaged pixels in value, BUFFER_RELEASE has
+ * the buffer number in id. Key codes, buttons and positions are never
+ * recorded.
+ *
+ * A probe log file is a PROBE_HEADER_SIZE byte header (PROBE_MAGIC followed
+ * by a little-endian uint32 PROBE_VERSION) and PROBE_RECORD_SIZE byte
+ * records laid out as int64 time_us, uint32 id, int32 value, then uint8
+ * point, index, kind and a zero byte, all little-endian.
+ */
+struct probe_record {
+  int64_t time_us;
+  uint32_t id;
+  int32_t value;
+  uint8_t point;
+  uint8_t index;
+  uint8_t kind;
+};
+
+/*
+ * The always-on flight recorder of the most recent PROBE_RING_SIZE probe
+ * records, dumped on SIGUSR2. With --probe-log, every record is also
+ * appended to file.
+ */
+struct probe_log {
+  struct probe_record ring[PROBE_RING_SIZE];
+  uint64_t count;
+  FILE *file;
+  bool dirty;
+};
+
+/*
+ * A serialized xkb modifier state, as sent to the virtual keyboard.
+ */
+struct kb_modifiers {
+  uint32_t depressed;
+  uint32_t latched;
+  uint32_t locked;
+  uint32_t group;
+};
+
+/*
+ * The kinds of input kloak forwards.
+ */
+enum input_event_type {
+  INPUT_EVENT_MOTION,
+  INPUT_EVENT_MOTION_ABSOLUTE,
+  INPUT_EVENT_BUTTON,
+  INPUT_EVENT_SCROLL,
+  INPUT_EVENT_KEY,
+};
+
+enum scroll_source {
+  SCROLL_SOURCE_WHEEL,
+  SCROLL_SOURCE_FINGER,
+  SCROLL_SOURCE_CONTINUOUS,
+};
+
+/*
+ * An input event decoded from libinput (or a trace) into plain values, so
+ * that nothing downstream of the decoder needs to keep libinput objects
+ * alive. Which fields are meaningful depends on the type.
+ */
+struct decoded_event {
+  enum input_event_type type;
+  /* Device timestamp in microseconds of CLOCK_MONOTONIC, or -1 */
+  int64_t time_us;
+  /* Relative motion in pixels, or absolute position in [0, 1] */
+  double dx;
+  double dy;
+  /* Buttons and keys, as evdev codes */
+  uint32_t code;
+  bool pressed;
+  /* Scrolling */
+  enum scroll_source scroll_source;
+  bool has_vert;
+  bool has_horiz;
+  double vert;
+  double horiz;
+};
+
 /*
  * Defines a buffered input event. Two types of events are supported, mouse
- * movement events and libinput events. libinput events can be any arbitrary
- * event supported by libinput. Mouse movement events are defined as a cursor
- * position in compositor global space. Both kinds of events have a scheduled
- * release time. An `entries` field is included to allow buffered events to be
- * stored in a tail queue.
+ * movement events and discrete input events. Discrete events are buttons,
+ * scrolling and keys, stored as a decoded input_event. Mouse movement events
+ * are defined as a cursor position in compositor global space. Both kinds of
+ * events have a scheduled release time. Packets are stored by value in a
+ * packet_ring.
  */
 struct input_packet {
-  bool is_libinput;
+  bool is_motion;
 
-  /* libinput-specific bits */
-  struct libinput_event * li_event;
-  enum libinput_event_type li_event_type;
+  /* discrete event bits */
+  struct decoded_event ev;
 
   /* mouse movement bits */
   uint32_t cursor_x;
   uint32_t cursor_y;
 
-  /* generic bits */
+  /* generic bits, in microseconds of CLOCK_MONOTONIC */
+  int64_t event_time;
   int64_t sched_time;
-  TAILQ_ENTRY(input_packet) entries;
+  /* Names the packet in probe records */
+  uint32_t id;
+};
+
+/*
+ * A FIFO of input packets, stored contiguously in a power-of-two sized ring.
+ * Release times are monotonic, so packets always leave in the order they
+ * were queued. When the ring is full it doubles in size; grow_count and
+ * high_water record how often that happens and how deep the queue gets.
+ */
+struct packet_ring {
+  struct input_packet *packets;
+  size_t capacity;
+  size_t first;
+  size_t len;
+  size_t high_water;
+  uint64_t grow_count;
+};
+
+/*
+ * State of the userspace CSPRNG. This is a ChaCha20 keystream generator
+ * seeded from getrandom(), refilled CSPRNG_BUF_SIZE bytes at a time and
+ * reseeded every CSPRNG_RESEED_BYTES bytes of output.
+ */
+struct csprng_state {
+  uint32_t input[16];
+  uint8_t buf[CSPRNG_BUF_SIZE];
+  size_t buf_pos;
+  uint64_t bytes_since_reseed;
+};
+
+/*
+ * A compiled keymap and the text it was compiled from. text is the mmap of
+ * the keymap fd the compositor sent; hash is hash_bytes() over it.
+ */
+struct keymap_cache_entry {
+  uint64_t hash;
+  char *text;
+  uint32_t size;
+  struct xkb_keymap *keymap;
+  uint64_t last_used;
+};
+
+/*
+ * The last KEYMAP_CACHE_SIZE keymaps received, so that switching back to a
+ * known layout doesn't recompile it. The least recently used entry is
+ * evicted. active is the entry xkb_state was built from.
+ */
+struct keymap_cache {
+  struct keymap_cache_entry entries[KEYMAP_CACHE_SIZE];
+  struct keymap_cache_entry *active;
+  uint64_t clock;
+};
+
+/*
+ * A wl_seat advertised by the compositor. Its name and capabilities arrive
+ * as events after binding; ctx is the seat_context it was matched to by
+ * name, or NULL.
+ */
+struct seat_binding {
+  struct wl_seat *seat;
+  char *name;
+  uint32_t caps;
+  struct seat_context *ctx;
 };
 
 /*
@@ -113,17 +587,11 @@ struct disp_state {
   struct wl_registry *registry;
   struct wl_shm *shm;
   struct wl_compositor *compositor;
-  struct wl_seat *seat;
-  const char *seat_name;
-  uint32_t seat_caps;
-  bool seat_set;
-  struct wl_keyboard *kb;
-  struct wl_output *outputs[MAX_DRAWABLE_LAYERS];
-  int output_names[MAX_DRAWABLE_LAYERS];
+  struct seat_binding *seat_bindings[MAX_WAYLAND_SEATS];
+  size_t seat_binding_count;
   struct zxdg_output_manager_v1 *xdg_output_manager;
-  struct zxdg_output_v1 *xdg_outputs[MAX_DRAWABLE_LAYERS];
-  struct output_geometry *output_geometries[MAX_DRAWABLE_LAYERS];
-  struct output_geometry *pending_output_geometries[MAX_DRAWABLE_LAYERS];
+  struct output_index output_index;
+  struct output_topology topology;
   uint32_t global_space_width;
   uint32_t global_space_height;
   uint32_t pointer_space_x;
@@ -131,28 +599,185 @@ struct disp_state {
   struct zwlr_layer_shell_v1 *layer_shell;
   struct zwlr_virtual_pointer_manager_v1 *virt_pointer_manager;
   struct zwp_virtual_keyboard_manager_v1 *virt_kb_manager;
-  struct zwp_virtual_keyboard_v1 *virt_kb;
+  struct xkb_context *xkb_ctx;
+  /* Dense table of connected outputs, indexed by drawable_layer.idx */
+  struct drawable_layer **layers;
+  size_t layer_count;
+  size_t layer_capacity;
+  /* Layers with frame_pending set, in the order they became dirty */
+  struct drawable_layer **dirty_layers;
+  size_t dirty_count;
+};
+
+enum scroll_axis {
+  SCROLL_AXIS_VERTICAL,
+  SCROLL_AXIS_HORIZONTAL,
+};
+
+/*
+ * The sink released input and cursor frames are written to. The core keeps
+ * track of pointer frames and modifier state and calls these in protocol
+ * order; a backend only has to translate each call. Times are in
+ * milliseconds, an axis value of zero means an axis stop. Every call but
+ * draw_layer is on behalf of one seat.
+ */
+struct output_backend {
+  const char *name;
+  void (*motion)(struct seat_context *seat, uint32_t ts_milliseconds,
+    uint32_t x, uint32_t y, uint32_t x_extent, uint32_t y_extent);
+  void (*button)(struct seat_context *seat, uint32_t ts_milliseconds,
+    uint32_t button, bool pressed);
+  void (*axis)(struct seat_context *seat, uint32_t ts_milliseconds,
+    enum scroll_axis axis, double value);
+  void (*axis_source)(struct seat_context *seat, enum scroll_source source);
+  void (*frame)(struct seat_context *seat);
+  void (*modifiers)(struct seat_context *seat,
+    const struct kb_modifiers *mods);
+  void (*key)(struct seat_context *seat, uint32_t ts_milliseconds,
+    uint32_t key, bool pressed);
+  void (*flush)(struct seat_context *seat);
+  void (*draw_layer)(struct drawable_layer *layer);
+};
+
+/*
+ * Requests seen by the counting backend, and the number of bytes they would
+ * have taken on the Wayland socket.
+ */
+struct backend_counters {
+  uint64_t motion;
+  uint64_t button;
+  uint64_t axis;
+  uint64_t axis_source;
+  uint64_t frame;
+  uint64_t modifiers;
+  uint64_t key;
+  uint64_t flush;
+  uint64_t draw;
+  uint64_t bytes;
+};
+
+/*
+ * An input event handed from the capture thread to the main thread, with the
+ * time it was read from libinput in microseconds.
+ */
+struct capture_entry {
+  struct decoded_event ev;
+  int64_t capture_time;
+};
+
+/*
+ * A lock-free single-producer, single-consumer ring of capture entries, used
+ * by --capture-thread. head and tail count entries popped and pushed over
+ * the ring's lifetime and live on separate cache lines; capacity is a power
+ * of two. high_water is only touched by the consumer.
+ */
+struct capture_ring {
+  struct capture_entry *entries;
+  size_t capacity;
+  size_t high_water;
+  _Alignas(64) _Atomic size_t head;
+  _Alignas(64) _Atomic size_t tail;
+  _Atomic uint64_t full_waits;
+};
+
+/*
+ * Settings and outcome of --realtime. policy and cpus are what was asked
+ * for; the remaining fields record what was actually achieved, for the
+ * stats dump.
+ */
+struct realtime_config {
+  bool enabled;
+  int policy;
+  bool have_affinity;
+  cpu_set_t cpus;
+  bool memory_locked;
+  bool affinity_set;
+  int achieved_policy;
+  int achieved_priority;
+  size_t prefaulted_bytes;
+};
+
+/*
+ * Startup milestones, in microseconds of CLOCK_MONOTONIC, or 0 if not
+ * reached. deadline is start plus --start-delay, the longest startup may
+ * wait for the compositor.
+ */
+struct startup_timing {
+  int64_t start;
+  int64_t deadline;
+  int64_t socket_ready;
+  int64_t globals_ready;
+  int64_t keymap_ready;
+  int64_t ready;
+  bool timed_out;
+};
+
+/*
+ * Everything kloak keeps per seat: the libinput context reading the seat's
+ * devices, the Wayland seat and virtual devices its input is released
+ * through, keyboard state, and the scheduler with its queue and virtual
+ * cursor. Seats are scheduled independently, only the outputs are shared.
+ */
+struct seat_context {
+  size_t idx;
+  const char *name;
+  /* With no --seat given, use whichever Wayland seat comes first */
+  bool match_any_wl_seat;
+  struct libinput *li;
+  /* Wayland side */
+  struct seat_binding *binding;
+  struct wl_keyboard *kb;
   struct zwlr_virtual_pointer_v1 *virt_pointer;
+  struct zwp_virtual_keyboard_v1 *virt_kb;
   bool virt_kb_keymap_set;
-  struct xkb_context *xkb_ctx;
+  /* Borrowed from keymap_cache.active */
   struct xkb_keymap *xkb_keymap;
   struct xkb_state *xkb_state;
-  char *old_kb_map_shm;
-  uint32_t old_kb_map_shm_size;
-  struct drawable_layer *layers[MAX_DRAWABLE_LAYERS];
+  struct keymap_cache keymap_cache;
+  /* Modifier state most recently sent to virt_kb */
+  struct kb_modifiers sent_mods;
+  bool sent_mods_valid;
+  /*
+   * Scheduler, cursor positions are in compositor global space. They keep
+   * sub-pixel motion, which is truncated wherever a pixel is needed.
+   */
+  double cursor_x;
+  double cursor_y;
+  double prev_cursor_x;
+  double prev_cursor_y;
+  int64_t prev_release_time;
+  struct packet_ring packet_queue;
+  struct adaptive_delay adaptive_delay;
+  bool pointer_frame_open;
+  bool pointer_frame_has_axis;
+  /* --capture-thread */
+  struct capture_ring capture_ring;
+  int capture_event_fd;
+  pthread_t capture_thread;
 };
 
-/***************/
-/* core unions */
-/***************/
+/*
+ * The /dev/uinput device written to by the uinput backend. Events are
+ * buffered until the backend is flushed. wheel_remainder holds high
+ * resolution scroll (vertical, horizontal) not yet reported as a whole
+ * detent.
+ */
+struct uinput_device {
+  int fd;
+  struct input_event buf[UINPUT_BUF_EVENTS];
+  size_t len;
+  int32_t wheel_remainder[2];
+};
 
 /*
- * A 64-bit unsigned integer with direct access to the constituent bytes. Used
- * to allow getting 64-bit integers from /dev/urandom.
+ * Identifies which fd woke up the main loop. Stored in epoll_event.data.
  */
-union rand_uint64 {
-  uint64_t val;
-  char raw[sizeof(uint64_t)];
+enum epoll_src {
+  EPOLL_SRC_WAYLAND,
+  EPOLL_SRC_LIBINPUT,
+  EPOLL_SRC_TIMER,
+  EPOLL_SRC_SIGNAL,
+  EPOLL_SRC_CAPTURE,
 };
 
 /*********************/
@@ -160,12 +785,47 @@ union rand_uint64 {
 /*********************/
 
 /*
- * Reads the specified number of random bytes from /dev/urandom into the
+ * Little-endian load and store helpers used by the ChaCha20 code.
+ */
+static uint32_t load_le32(const uint8_t *p);
+static void store_le32(uint8_t *p, uint32_t val);
+
+/*
+ * Computes one 64-byte ChaCha20 keystream block from the specified input
+ * state.
+ */
+static void chacha20_block(const uint32_t input[16], uint8_t output[64]);
+
+/*
+ * Fills the specified buffer with random bytes from the kernel using
+ * getrandom(). Only used to seed and reseed the CSPRNG.
+ */
+static void read_os_random(uint8_t *buf, size_t len);
+
+/*
+ * Mixes fresh kernel entropy into the CSPRNG key and nonce.
+ */
+static void csprng_reseed(void);
+
+/*
+ * Refills the CSPRNG output buffer, rotating the key in the process.
+ */
+static void csprng_refill(void);
+
+/*
+ * Reads the specified number of random bytes from the CSPRNG into the
  * specified buffer. applayer_random_init must be called before this function
- * will behave as intended.
+ * will behave as intended. Does not make any syscalls except when a reseed is
+ * due.
  */
 static void read_random(char * buf, size_t len);
 
+/*
+ * Returns a uniformly distributed random number in the range [0, bound),
+ * using rejection sampling to avoid modulo bias.
+ */
+static uint64_t random_uniform(uint64_t bound);
+
 /*
  * Populates a string with a number of random characters in the set [a-zA-Z].
  */
@@ -177,13 +837,25 @@ static void randname(char *buf, size_t len);
 static int create_shm_file(size_t size);
 
 /*
- * Returns a monotonic 64-bit timestamp.
+ * Returns a monotonic 64-bit timestamp in microseconds.
+ */
+static int64_t current_time_us(void);
+
+/*
+ * Returns a monotonic 64-bit timestamp in nanoseconds.
+ */
+static int64_t current_time_ns(void);
+
+/*
+ * Returns the CLOCK_MONOTONIC timestamp libinput recorded for an event in
+ * microseconds, or -1 for event types that carry no timestamp.
  */
-static int64_t current_time_ms(void);
+static int64_t libinput_event_time_us(enum libinput_event_type ev_type,
+  struct libinput_event *li_event);
 
 /*
- * Generates a random 64-bit number between the two specified numbers. Uses
- * /dev/urandom as its source.
+ * Generates a random 64-bit number between the two specified numbers,
+ * inclusive. Uses the CSPRNG as its source.
  */
 static int64_t random_between(int64_t lower, int64_t upper);
 
@@ -200,17 +872,57 @@ static bool check_point_in_area(uint32_t x, uint32_t y, uint32_t rect_x,
 static bool check_screen_touch(struct output_geometry scr1,
   struct output_geometry scr2);
 
+/*
+ * Finds the representative of an output's set in the topology forest.
+ */
+static size_t topology_find(struct output_topology *topo, size_t idx);
+
+/*
+ * Merges the sets containing two outputs in the topology forest.
+ */
+static void topology_union(struct output_topology *topo, size_t a,
+  size_t b);
+
+/*
+ * Marks the global space as stale. If rebuild is set, the topology forest is
+ * discarded rather than extended. The recalculation itself happens on the
+ * next call to recalc_global_space().
+ */
+static void schedule_global_space_recalc(struct disp_state *state,
+  bool rebuild);
+
 /*
  * Calculates the size of the global compositor space and the location of the
  * upper-left corner of the pointer's coordinate space from the geometries of
- * the active displays. The function detects if there are gaps between the
- * displays and aborts the program if so.
+ * the active displays, and rebuilds the output index. Does nothing unless a
+ * recalculation was scheduled. The function detects if there are gaps
+ * between the displays and aborts the program if so.
  */
 static void recalc_global_space(struct disp_state * state);
 
+/*
+ * qsort comparator for output_index entries, ordering by x and then by output
+ * index.
+ */
+static int compare_output_index_entries(const void *a, const void *b);
+
+/*
+ * Rebuilds the output index from the current output geometries. Must be
+ * called whenever an output is added, removed, or changes geometry.
+ */
+static void rebuild_output_index(struct disp_state *state);
+
+/*
+ * Determine if a point falls inside the area covered by an output index
+ * entry.
+ */
+static bool output_index_entry_contains(struct output_index_entry *entry,
+  int32_t x, int32_t y);
+
 /*
  * Converts a set of coordinates in global compositor space to a set of
- * coordinates in screen-local space.
+ * coordinates in screen-local space. If screens overlap, the screen with the
+ * lowest output index wins.
  */
 static struct screen_local_coord abs_coord_to_screen_local_coord(int32_t x,
   int32_t y);
@@ -223,21 +935,96 @@ static struct coord screen_local_coord_to_abs_coord(uint32_t x, uint32_t y,
   int32_t output_idx);
 
 /*
- * Takes two points that define a line on a 2d plane, and walks the specified
- * number of pixels from the start point towards the "end" point. Note that
- * you *can* walk past the end point, and that the end point is NOT guaranteed
- * to be one of the values this function outputs.
+ * Initializes a line iterator that walks from start towards end. The
+ * iterator starts at position 0, i.e. on the start point.
+ */
+static void line_iter_init(struct line_iter *iter, struct coord start,
+  struct coord end);
+
+/*
+ * Returns the point with the specified offsets from the start point along
+ * the major and minor axes of a line iterator's line.
  */
-static struct coord traverse_line(struct coord start, struct coord end,
+static struct coord line_iter_point(const struct line_iter *iter,
+  int32_t major_off, int32_t minor_off);
+
+/*
+ * Advances a line iterator by one pixel. Note that you *can* walk past the
+ * end point.
+ */
+static void line_iter_next(struct line_iter *iter);
+
+/*
+ * Returns the point a line iterator would be on at the specified position,
+ * without moving the iterator.
+ */
+static struct coord line_iter_coord_at(const struct line_iter *iter,
   int32_t pos);
 
 /*
- * Draws a virtual cursor block on the specified pixel buffer. If crosshair is
- * set to true, crosshairs representing the cursor will be drawn in the block,
- * otherwise the block will simply blank out anything that it is drawing over.
+ * Moves a line iterator directly to the specified position.
+ */
+static void line_iter_seek(struct line_iter *iter, int32_t pos);
+
+/*
+ * Returns the first position at which the line iterator's offset from the
+ * start point along the X axis (if x_axis is true) or the Y axis (otherwise)
+ * is at least offset. Returns INT64_MAX if the line never moves that far.
+ */
+static int64_t line_iter_offset_pos(const struct line_iter *iter,
+  bool x_axis, int64_t offset);
+
+/*
+ * Allocates the specified sprite and renders crosshairs of the specified
+ * radius and color into it. Everything other than the crosshairs is
+ * transparent.
+ */
+static void render_crosshair_sprite(struct cursor_sprite *sprite,
+  int32_t rad, uint32_t color);
+
+/*
+ * Clips the square block of the specified radius centered on (x, y) to a
+ * layer of the specified size. Returns false if nothing of the block is left.
+ */
+static bool clip_block(int32_t x, int32_t y, int32_t layer_width,
+  int32_t layer_height, int32_t rad, struct block_clip *clip);
+
+/*
+ * Blanks out the square block of the specified radius centered on (x, y) in
+ * the specified pixel buffer.
+ */
+static void clear_block(uint32_t *pixbuf, int32_t x, int32_t y,
+  int32_t layer_width, int32_t layer_height, int32_t rad);
+
+/*
+ * Copies a cursor sprite, centered on (x, y), into the specified pixel
+ * buffer. Transparent sprite pixels overwrite whatever is under them.
  */
-static void draw_block(uint32_t * pixbuf, int32_t x, int32_t y,
-  int32_t layer_width, int32_t layer_height, int32_t rad, bool crosshair);
+static void blit_sprite(uint32_t *pixbuf, int32_t x, int32_t y,
+  int32_t layer_width, int32_t layer_height,
+  const struct cursor_sprite *sprite);
+
+/*
+ * A fast, non-cryptographic 64-bit hash of a byte buffer.
+ */
+static uint64_t hash_bytes(const void *data, size_t len);
+
+/*
+ * Finds the cache entry holding exactly the specified keymap text and marks
+ * it as used, or returns NULL.
+ */
+static struct keymap_cache_entry *keymap_cache_lookup(
+  struct keymap_cache *cache, uint64_t hash, const char *text,
+  uint32_t size);
+
+/*
+ * Adds a compiled keymap to the cache, evicting the least recently used
+ * entry if the cache is full. The cache takes ownership of the keymap
+ * reference and of text, an mmap of size bytes.
+ */
+static struct keymap_cache_entry *keymap_cache_insert(
+  struct keymap_cache *cache, uint64_t hash, char *text, uint32_t size,
+  struct xkb_keymap *keymap);
 
 /*
  * Parse an option parameter as an unsigned integer.
@@ -245,9 +1032,204 @@ static void draw_block(uint32_t * pixbuf, int32_t x, int32_t y,
 static int32_t parse_uintarg(const char *arg_name, const char *val);
 
 /*
- * Sleeps for the specified number of milliseconds.
+ * Returns the number of milliseconds left until a CLOCK_MONOTONIC deadline
+ * in microseconds, rounded up, or 0 if it has passed.
+ */
+static int ms_until(int64_t deadline);
+
+/*
+ * Allocates storage for a packet ring. capacity must be a power of two.
+ */
+static void packet_ring_init(struct packet_ring *ring, size_t capacity);
+
+/*
+ * Doubles the capacity of a packet ring, preserving packet order.
+ */
+static void packet_ring_grow(struct packet_ring *ring);
+
+/*
+ * Returns the oldest or newest packet in a packet ring, or NULL if the ring
+ * is empty.
+ */
+static struct input_packet *packet_ring_first(struct packet_ring *ring);
+static struct input_packet *packet_ring_last(struct packet_ring *ring);
+
+/*
+ * Appends a zeroed packet to the end of a packet ring, growing the ring if
+ * needed, and returns it. Pointers previously returned by the packet_ring_*
+ * functions are invalidated if the ring grows.
+ */
+static struct input_packet *packet_ring_push(struct packet_ring *ring);
+
+/*
+ * Removes the oldest packet from a packet ring.
+ */
+static void packet_ring_pop(struct packet_ring *ring);
+
+/*
+ * Allocates an empty capture ring. capacity must be a power of two.
+ */
+static void capture_ring_init(struct capture_ring *ring, size_t capacity);
+
+/*
+ * Appends a copy of entry to the ring. Only called by the capture thread.
+ * Returns false if the ring is full.
+ */
+static bool capture_ring_push(struct capture_ring *ring,
+  const struct capture_entry *entry);
+
+/*
+ * Removes the oldest entry from the ring into entry. Only called by the main
+ * thread. Returns false if the ring is empty.
+ */
+static bool capture_ring_pop(struct capture_ring *ring,
+  struct capture_entry *entry);
+
+/*
+ * Returns true if the ring holds no entries. Only called by the main thread.
+ */
+static bool capture_ring_empty(struct capture_ring *ring);
+
+/*
+ * Parses a comma-separated list of CPU numbers for --cpu-affinity. Exits
+ * on invalid input.
+ */
+static void parse_cpu_list(const char *val, cpu_set_t *cpus);
+
+/*
+ * Adds a seat_context for --seat. Exits on duplicates or past MAX_SEATS.
+ */
+static void add_seat(const char *name);
+
+/*
+ * Touches every page of a memory region so that later writes don't fault.
+ * Returns the number of bytes prefaulted.
+ */
+static size_t prefault_memory(void *addr, size_t len);
+
+/*
+ * Touches REALTIME_STACK_PREFAULT_BYTES of the calling thread's stack.
+ */
+static void prefault_stack(void);
+
+/*
+ * Adds an fd to the main loop's epoll set. src is handed back in
+ * epoll_event.data when the fd becomes readable.
+ */
+static void add_epoll_fd(int fd, uint32_t src);
+
+/*
+ * Arms the release timer so that the main loop wakes up when the earliest
+ * packet at the head of any seat's queue is due, or disarms it if every
+ * queue is empty. Does
+ * nothing if the timer is already armed for the right deadline.
+ */
+static void arm_release_timer(void);
+
+/*
+ * Maps a value to its histogram bucket, and a bucket back to the largest
+ * value it holds.
+ */
+static size_t histogram_bucket_index(uint64_t value);
+static uint64_t histogram_bucket_value(size_t idx);
+
+/*
+ * Adds a value to a histogram. Negative values are recorded as zero.
  */
-static void sleep_ms(long ms);
+static void histogram_record(struct histogram *hist, int64_t value);
+
+/*
+ * Returns the value at the given percentile of a histogram, expressed in
+ * tenths of a percent.
+ */
+static uint64_t histogram_percentile(const struct histogram *hist,
+  uint32_t permille);
+
+/*
+ * Prints a histogram summary to stderr as a single key=value line.
+ */
+static void dump_histogram(const char *name, const struct histogram *hist);
+
+/*
+ * Converts a value to the fixed-point representation used in traces,
+ * saturating at the int32_t range.
+ */
+static int32_t trace_fixed(double value, double one);
+
+/*
+ * Serialize and deserialize one trace record of TRACE_RECORD_SIZE bytes.
+ */
+static void trace_encode_record(const struct trace_record *rec,
+  uint8_t *buf);
+static void trace_decode_record(const uint8_t *buf,
+  struct trace_record *rec);
+
+/*
+ * Converts an input trace record to a decoded_event with the given
+ * timestamp. Returns false for records that are not input.
+ */
+static bool trace_record_to_input_event(const struct trace_record *rec,
+  int64_t time_us, struct decoded_event *ev);
+
+/*
+ * Creates a trace file at path and writes the header. The file must not
+ * already exist.
+ */
+static void trace_open_writer(const char *path);
+
+/*
+ * Appends a record to the trace, filling in its time delta from time_us.
+ * Does nothing if no trace is being recorded.
+ */
+static void trace_write_record(struct trace_record *rec, int64_t time_us);
+
+/*
+ * Append an input event, or the current output layout, to the trace.
+ */
+static void trace_record_input_event(const struct decoded_event *ev);
+static void trace_record_layout(struct disp_state *state);
+
+/*
+ * Writes a record to the probe ring, to the --probe-log file if one is open,
+ * and to the USDT probe kloak:probe in builds with KLOAK_USDT.
+ */
+static void probe_record(enum probe_point point, size_t index, uint32_t kind,
+  uint32_t id, int64_t value, int64_t time_us);
+
+/*
+ * Creates the --probe-log file at path and writes the header. The file must
+ * not exist yet.
+ */
+static void probe_open_log(const char *path);
+
+/*
+ * Prints the records in the probe ring, oldest first, to stderr.
+ */
+static void probe_dump(void);
+
+/*
+ * Flushes buffered trace and probe log records to disk if any were written
+ * since the last flush.
+ */
+static void trace_flush(void);
+
+/*
+ * Prints event loop statistics and metrics to stderr, one "kloak <section>:"
+ * line of space-separated key=value pairs per record. Triggered by SIGUSR1.
+ */
+static void dump_stats(void);
+
+/*
+ * Returns the time from startup.start to a startup milestone, or -1 if it
+ * was never reached.
+ */
+static int64_t startup_elapsed_us(int64_t when);
+
+/*
+ * Prints the name of the output backend, and its counters if it is the
+ * counting backend.
+ */
+static void dump_backend_stats(void);
 
 /********************/
 /* wayland handling */
@@ -259,6 +1241,11 @@ static void registry_handle_global_remove(void *data,
   struct wl_registry * registry, uint32_t name);
 static void seat_handle_name(void *data, struct wl_seat *seat,
   const char *name);
+/*
+ * Gets or releases the keyboard of the seat_context a Wayland seat is
+ * assigned to, following the seat's capabilities.
+ */
+static void seat_binding_update_keyboard(struct seat_binding *binding);
 static void seat_handle_capabilities(void *data, struct wl_seat *seat,
   uint32_t capabilities);
 static void kb_handle_keymap(void *data, struct wl_keyboard *kb,
@@ -297,6 +1284,8 @@ static void xdg_output_handle_name(void *data,
   struct zxdg_output_v1 *xdg_output, const char *name);
 static void xdg_output_handle_description(void *data,
   struct zxdg_output_v1 *xdg_output, const char *description);
+static void layer_frame_done(void *data, struct wl_callback *callback,
+  uint32_t callback_data);
 static void layer_surface_configure(void *data,
   struct zwlr_layer_surface_v1 *layer_surface, uint32_t serial, uint32_t width,
   uint32_t height);
@@ -316,19 +1305,123 @@ static int li_open_restricted(const char *path, int flags, void * user_data);
  */
 static void li_close_restricted(int fd, void *user_data);
 
+/*******************/
+/* output backends */
+/*******************/
+
+/*
+ * The Wayland backend, talking to the compositor through
+ * zwlr_virtual_pointer_v1 and zwp_virtual_keyboard_v1. Key events are
+ * dropped until the keymap has been sent.
+ */
+static void wayland_backend_motion(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t x, uint32_t y, uint32_t x_extent,
+  uint32_t y_extent);
+static void wayland_backend_button(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t button, bool pressed);
+static void wayland_backend_axis(struct seat_context *seat,
+  uint32_t ts_milliseconds, enum scroll_axis axis, double value);
+static void wayland_backend_axis_source(struct seat_context *seat,
+  enum scroll_source source);
+static void wayland_backend_frame(struct seat_context *seat);
+static void wayland_backend_modifiers(struct seat_context *seat,
+  const struct kb_modifiers *mods);
+static void wayland_backend_key(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t key, bool pressed);
+static void wayland_backend_flush(struct seat_context *seat);
+
+/*
+ * The null backend, which discards everything. Layers are marked as drawn
+ * so that the dirty list drains.
+ */
+static void null_backend_motion(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t x, uint32_t y, uint32_t x_extent,
+  uint32_t y_extent);
+static void null_backend_button(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t button, bool pressed);
+static void null_backend_axis(struct seat_context *seat,
+  uint32_t ts_milliseconds, enum scroll_axis axis, double value);
+static void null_backend_axis_source(struct seat_context *seat,
+  enum scroll_source source);
+static void null_backend_frame(struct seat_context *seat);
+static void null_backend_modifiers(struct seat_context *seat,
+  const struct kb_modifiers *mods);
+static void null_backend_key(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t key, bool pressed);
+static void null_backend_flush(struct seat_context *seat);
+static void null_backend_draw_layer(struct drawable_layer *layer);
+
+/*
+ * The counting backend, which discards everything but records it in
+ * backend_counters.
+ */
+static void counting_backend_motion(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t x, uint32_t y, uint32_t x_extent,
+  uint32_t y_extent);
+static void counting_backend_button(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t button, bool pressed);
+static void counting_backend_axis(struct seat_context *seat,
+  uint32_t ts_milliseconds, enum scroll_axis axis, double value);
+static void counting_backend_axis_source(struct seat_context *seat,
+  enum scroll_source source);
+static void counting_backend_frame(struct seat_context *seat);
+static void counting_backend_modifiers(struct seat_context *seat,
+  const struct kb_modifiers *mods);
+static void counting_backend_key(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t key, bool pressed);
+static void counting_backend_flush(struct seat_context *seat);
+static void counting_backend_draw_layer(struct drawable_layer *layer);
+
+/*
+ * The uinput backend, writing evdev events to a virtual device that the
+ * compositor picks up like any other input device. Modifiers, axis stops and
+ * axis sources have no evdev equivalent and are dropped.
+ */
+static void uinput_backend_append(uint16_t type, uint16_t code,
+  int32_t value);
+static void uinput_backend_motion(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t x, uint32_t y, uint32_t x_extent,
+  uint32_t y_extent);
+static void uinput_backend_button(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t button, bool pressed);
+static void uinput_backend_axis(struct seat_context *seat,
+  uint32_t ts_milliseconds, enum scroll_axis axis, double value);
+static void uinput_backend_axis_source(struct seat_context *seat,
+  enum scroll_source source);
+static void uinput_backend_frame(struct seat_context *seat);
+static void uinput_backend_modifiers(struct seat_context *seat,
+  const struct kb_modifiers *mods);
+static void uinput_backend_key(struct seat_context *seat,
+  uint32_t ts_milliseconds, uint32_t key, bool pressed);
+static void uinput_backend_flush(struct seat_context *seat);
+
 /************************/
 /* high-level functions */
 /************************/
 
 /*
  * Attempts to update the specified layer to display the virtual cursor at the
- * right location. May do nothing if the compositor has not yet acknowledged a
- * previously sent frame, there is no pending changes that affect the
- * specified layer, or kloak hasn't yes negotiated an appropriate
- * configuration for the layer with the compositor.
+ * right location. May do nothing if the compositor hasn't yet signaled (via a
+ * frame callback) that the previous frame was presented, the compositor is
+ * still holding all of the layer's buffers, or kloak hasn't yet negotiated an
+ * appropriate configuration for the layer with the compositor. Commits are
+ * thus paced to the output's refresh rate.
  */
 static void draw_frame(struct drawable_layer *layer);
 
+/*
+ * Helper for draw_frame(). Notes that the layer's pending frame has to wait
+ * for the compositor, counting it as skipped the first time this happens to
+ * that frame.
+ */
+static void defer_frame(struct drawable_layer *layer);
+
+/*
+ * Destroys the specified layer's buffers and shm pool, and unmaps its pixel
+ * memory.
+ */
+static void destroy_layer_buffers(struct drawable_layer *layer);
+
 /*
  * Allocates a drawable_layer struct for the specified display, and registers
  * it with the compositor.
@@ -337,41 +1430,217 @@ static struct drawable_layer *allocate_drawable_layer(
   struct disp_state *state, struct wl_output *output);
 
 /*
- * Damages the specified region of the specified surface. Takes the same
- * arguments as wl_surface_damage_buffer, but clamps the x and y parameters to
- * 0 if they're below zero when passed in. This works around undesirable
- * behavior when passing negative x and y values to wl_surface_damage_buffer.
+ * Adds a layer to the end of the layer table, growing it as needed, and
+ * marks it dirty.
+ */
+static void insert_drawable_layer(struct disp_state *state,
+  struct drawable_layer *layer);
+
+/*
+ * Creates the xdg_output for a layer's wl_output and starts listening for
+ * geometry events on both.
+ */
+static void attach_xdg_output(struct disp_state *state,
+  struct drawable_layer *layer);
+
+/*
+ * Removes a layer from the layer table and the dirty list. Does not destroy
+ * any of its Wayland objects.
+ */
+static void remove_drawable_layer(struct disp_state *state,
+  struct drawable_layer *layer);
+
+/*
+ * Adds the specified layer to the dirty list unless it is already on it.
+ */
+static void mark_layer_dirty(struct drawable_layer *layer);
+
+/*
+ * Marks the specified layer as needing a redraw. If a redraw was already
+ * pending, the update will be folded into the same frame, which is counted
+ * in the layer's statistics.
+ */
+static void request_redraw(struct drawable_layer *layer);
+
+/*
+ * Area and bounding box helpers for damage rects.
+ */
+static int64_t damage_rect_area(const struct damage_rect *rect);
+static struct damage_rect damage_rect_union(const struct damage_rect *a,
+  const struct damage_rect *b);
+
+/*
+ * Records that the specified region (in buffer coordinates) of the specified
+ * layer changed in the frame being drawn. The region is clipped to the
+ * layer, and merged with already recorded regions where that doesn't grow
+ * the damaged area.
+ */
+static void damage_add(struct drawable_layer *layer, int32_t x, int32_t y,
+  int32_t width, int32_t height);
+
+/*
+ * Submits the damage recorded for the frame being drawn to the compositor,
+ * updates the layer's damage statistics, and resets the damage tracker.
  */
-static void damage_surface_enh(struct wl_surface *surface, int32_t x,
-  int32_t y, int32_t width, int32_t height);
+static void damage_flush(struct drawable_layer *layer);
 
 /*
- * Updates the virtual cursor's position based on the global cursor_x and
- * cursor_y variables. This will create a new mouse movement event if there
- * isn't one already queued, and update a queued mouse movement event to
- * reflect the current virtual cursor position otherwise.
+ * Returns how far a coordinate starting at from and moving in direction step
+ * has to travel to leave the range [lo, hi).
  */
-static struct input_packet * update_virtual_cursor(uint32_t ts_milliseconds);
+static int64_t axis_exit_offset(int32_t from, int32_t step, int32_t lo,
+  int32_t hi);
 
 /*
- * Processes a libinput event, sending emulated input to the compositor as
- * appropriate.
+ * Returns how far a coordinate starting at from and moving in direction step
+ * has to travel to enter the range [lo, hi). The result is zero or negative
+ * if it starts in the range or past it.
  */
-static void handle_libinput_event(enum libinput_event_type ev_type,
-  struct libinput_event *li_event, uint32_t ts_milliseconds);
+static int64_t axis_entry_offset(int32_t from, int32_t step, int32_t lo,
+  int32_t hi);
 
 /*
- * Schedules a libinput event for future release to the compositor. As a side
- * effect, also redraws the virtual cursor if needed.
+ * Finds the range of positions [first, last] at which the line iterator's X
+ * coordinate (if x_axis is true) or Y coordinate (otherwise) lies in
+ * [lo, hi). last is INT64_MAX if the line never leaves the range. Returns
+ * false if the line is never in the range.
+ */
+static bool axis_pos_range(const struct line_iter *iter, bool x_axis,
+  int32_t lo, int32_t hi, int64_t *first, int64_t *last);
+
+/*
+ * Helper for glide_cursor(). Given a line iterator whose current position
+ * lies on the specified output, returns the next position at which the walk
+ * either leaves that output or (if they haven't been hit yet) reaches the
+ * end point. All positions in between are guaranteed to be on the output.
+ */
+static int32_t next_walk_event(const struct line_iter *iter,
+  int32_t output_idx, bool end_x_hit, bool end_y_hit);
+
+/*
+ * Helper for glide_cursor(). Given a line iterator whose current position
+ * is on no output, returns the next position at which the walk either is on
+ * an output, could glide back onto one, or (if they haven't been hit yet)
+ * reaches the end point. Takes one pass over the outputs. All positions in
+ * between are guaranteed to be off screen with no output to glide onto.
+ */
+static int32_t next_offscreen_walk_event(const struct line_iter *iter,
+  bool end_x_hit, bool end_y_hit);
+
+/*
+ * Moves a point from start towards end without leaving the area covered by
+ * the screens, gliding along any screen edges that get in the way. Returns
+ * the point where the move ends up. The result is the same as walking the
+ * line between the points one pixel at a time, but long stretches of the
+ * walk that stay on a single screen, or away from all of them, are skipped
+ * over.
+ */
+static struct coord glide_cursor(struct coord start, struct coord end);
+
+/*
+ * Updates the virtual cursor's position based on the seat's cursor_x and
+ * cursor_y. This will push a new mouse movement event onto the seat's
+ * queue and return it if there isn't one already at the tail of the queue,
+ * and update the queued mouse movement event to reflect the current virtual
+ * cursor position and return NULL otherwise.
+ */
+static struct input_packet * update_virtual_cursor(struct seat_context *seat,
+  uint32_t ts_milliseconds);
+
+/*
+ * Decodes a libinput event into a decoded_event. Returns false for event
+ * types that kloak does not forward.
+ */
+static bool decode_libinput_event(enum libinput_event_type ev_type,
+  struct libinput_event *li_event, struct decoded_event *out);
+
+/*
+ * Sends a released packet to the output backend as emulated input.
+ */
+static void handle_input_packet(struct seat_context *seat,
+  const struct input_packet *packet);
+
+/*
+ * Ends a batch of released packets, closing the pointer frame and flushing
+ * the output backend.
+ */
+static void finish_input_batch(struct seat_context *seat);
+
+/*
+ * Takes ownership of a libinput event. Device hotplug is handled right away,
+ * forwarded input is decoded, recorded to the trace if one is open, and
+ * queued.
  */
 static void queue_libinput_event_and_relocate_virtual_cursor(
-  enum libinput_event_type li_event_type, struct libinput_event *li_event);
+  struct seat_context *seat, enum libinput_event_type li_event_type,
+  struct libinput_event *li_event);
+
+/*
+ * Takes ownership of a libinput event and destroys it. Device hotplug is
+ * handled right away; returns true if the event was decoded into ev for
+ * forwarding.
+ */
+static bool take_libinput_event(enum libinput_event_type li_event_type,
+  struct libinput_event *li_event, struct decoded_event *ev);
+
+/*
+ * Body of a --capture-thread thread, arg is its seat. Owns the seat's
+ * libinput context, and pushes every decoded event with its capture time
+ * into the seat's capture_ring, signalling capture_event_fd after each
+ * dispatch.
+ */
+static void *capture_thread_main(void *arg);
+
+/*
+ * Clears the seat's capture_event_fd and queues up to budget events waiting
+ * in its capture_ring (all of them if budget is 0), recording them to the
+ * trace if one is open. Returns true if events were left in the ring.
+ */
+static bool drain_capture_ring(struct seat_context *seat, size_t budget);
+
+/*
+ * Queues up to budget events (all of them if budget is 0) that libinput has
+ * read from the seat's devices. Returns true if events were left over.
+ */
+static bool drain_libinput_events(struct seat_context *seat, size_t budget);
+
+/*
+ * Folds a finger or continuous scroll event into tail, the newest queued
+ * packet, if tail scrolls the same axes from the same source and neither is
+ * an axis stop. Returns true if the event was absorbed.
+ */
+static bool coalesce_scroll_event(struct input_packet *tail,
+  const struct decoded_event *ev);
+
+/*
+ * Schedules a decoded input event for release and moves the virtual cursor
+ * for motion. current_time is the scheduler's notion of now in microseconds.
+ */
+static void queue_input_event_and_relocate_virtual_cursor(
+  struct seat_context *seat, const struct decoded_event *ev,
+  int64_t current_time);
+
+/*
+ * Returns the upper bound of the delay to draw for an event, in
+ * microseconds. This is max_delay unless --adaptive-delay is active, in which
+ * case the arrival statistics are updated first.
+ */
+static int64_t delay_window_us(struct seat_context *seat,
+  const struct decoded_event *ev, int64_t event_time);
+
+/*
+ * Sends the pointer frame for the events emitted since the last frame, if
+ * there were any.
+ */
+static void close_pointer_frame(struct seat_context *seat);
 
 /*
- * Finds all queued input events that are ready to be released, and process
- * them.
+ * Finds all of a seat's queued input events that are ready to be released,
+ * and process them as one batch. Modifier state is only sent when it changed, pointer
+ * events are grouped into a single frame, and the backend is flushed once.
  */
-static void release_scheduled_input_events(void);
+static void release_scheduled_input_events(struct seat_context *seat,
+  int64_t current_time);
 
 /*
  * Prints usage information.
@@ -383,25 +1652,87 @@ static void print_usage(void);
 /****************************/
 
 /*
- * Opens /dev/urandom so that other parts of the system that need random
- * values can get them.
+ * Seeds the CSPRNG so that other parts of the system that need random values
+ * can get them.
  */
 static void applayer_random_init(void);
 
+/*
+ * Pre-renders the virtual cursor sprite.
+ */
+static void applayer_cursor_init(void);
+
+/*
+ * Checks whether the compositor's socket, per $WAYLAND_DISPLAY and
+ * $XDG_RUNTIME_DIR, exists. path receives the socket path and name points
+ * at its final component, or is NULL if no path could be built.
+ */
+static bool wayland_socket_exists(char *path, size_t path_size,
+  const char **name);
+
+/*
+ * Waits with inotify until the compositor's socket appears, or
+ * startup.deadline passes.
+ */
+static void applayer_wait_for_wayland_socket(void);
+
+/*
+ * Readiness conditions for wayland_dispatch_until: every seat has a Wayland
+ * seat assigned, all required globals are bound, and every seat has received
+ * its first keymap.
+ */
+static bool wayland_seats_bound(void);
+static bool wayland_globals_ready(void);
+static bool wayland_keymap_ready(void);
+
+/*
+ * Dispatches Wayland events until ready() returns true or startup.deadline
+ * passes. Returns whether ready() was reached.
+ */
+static bool wayland_dispatch_until(bool (*ready)(void));
+
 /*
  * Connects to the wayland compositor and begins initialization of the Wayland
- * state.
+ * state. Returns once the keymap has arrived, or at startup.deadline.
  */
 static void applayer_wayland_init(void);
 
 /*
- * Opens all input devices on seat0 with libinput and prepares to process
- * events from them.
+ * Creates the virtual device used by the uinput backend. Called before
+ * libinput is initialized; li_open_restricted skips the device by its phys.
+ */
+static void applayer_uinput_init(void);
+
+/*
+ * Opens all input devices of each seat with a libinput context of its own
+ * and prepares to process events from them.
  */
 static void applayer_libinput_init(void);
 
 /*
- * Initializes the fd poll mechanism.
+ * Starts a --capture-thread thread per seat and adds their eventfds to the
+ * epoll set.
+ * Must run after applayer_poll_init, so the thread inherits a signal mask
+ * with SIGUSR1 and SIGUSR2 blocked.
+ */
+static void applayer_capture_init(void);
+
+/*
+ * Applies --realtime: locks memory, grows and prefaults the packet queues,
+ * pins the CPU affinity and switches the calling thread to SCHED_FIFO or
+ * SCHED_RR. Each step only warns on failure.
+ */
+static void applayer_realtime_init(void);
+
+/*
+ * Records the time startup finished and, when run as a systemd notify
+ * service, reports readiness on $NOTIFY_SOCKET.
+ */
+static void applayer_notify_ready(void);
+
+/*
+ * Initializes the epoll set, the release timer, and the SIGUSR1/SIGUSR2
+ * signalfd.
  */
 static void applayer_poll_init(void);
 
@@ -448,6 +1779,9 @@ static const struct zxdg_output_v1_listener xdg_output_listener = {
   .name = xdg_output_handle_name,
   .description = xdg_output_handle_description,
 };
+static const struct wl_callback_listener frame_callback_listener = {
+  .done = layer_frame_done,
+};
 static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
   .configure = layer_surface_configure,
 };
@@ -460,3 +1794,59 @@ static const struct libinput_interface li_interface = {
   .open_restricted = li_open_restricted,
   .close_restricted = li_close_restricted,
 };
+
+/*******************/
+/* output backends */
+/*******************/
+
+static const struct output_backend wayland_backend = {
+  .name = "wayland",
+  .motion = wayland_backend_motion,
+  .button = wayland_backend_button,
+  .axis = wayland_backend_axis,
+  .axis_source = wayland_backend_axis_source,
+  .frame = wayland_backend_frame,
+  .modifiers = wayland_backend_modifiers,
+  .key = wayland_backend_key,
+  .flush = wayland_backend_flush,
+  .draw_layer = draw_frame,
+};
+
+static const struct output_backend null_backend = {
+  .name = "null",
+  .motion = null_backend_motion,
+  .button = null_backend_button,
+  .axis = null_backend_axis,
+  .axis_source = null_backend_axis_source,
+  .frame = null_backend_frame,
+  .modifiers = null_backend_modifiers,
+  .key = null_backend_key,
+  .flush = null_backend_flush,
+  .draw_layer = null_backend_draw_layer,
+};
+
+static const struct output_backend counting_backend = {
+  .name = "counting",
+  .motion = counting_backend_motion,
+  .button = counting_backend_button,
+  .axis = counting_backend_axis,
+  .axis_source = counting_backend_axis_source,
+  .frame = counting_backend_frame,
+  .modifiers = counting_backend_modifiers,
+  .key = counting_backend_key,
+  .flush = counting_backend_flush,
+  .draw_layer = counting_backend_draw_layer,
+};
+
+static const struct output_backend uinput_backend = {
+  .name = "uinput",
+  .motion = uinput_backend_motion,
+  .button = uinput_backend_button,
+  .axis = uinput_backend_axis,
+  .axis_source = uinput_backend_axis_source,
+  .frame = uinput_backend_frame,
+  .modifiers = uinput_backend_modifiers,
+  .key = uinput_backend_key,
+  .flush = uinput_backend_flush,
+  .draw_layer = draw_frame,
+};
@@ -0,0 +1,742 @@
+/*
+ * Copyright (c) 2025 - 2025 ENCRYPTED SUPPORT LLC <adrelanos@whonix.org>
+ * See the file COPYING for copying conditions.
+ */
+
+/*
+ * kloak-microbench times kloak's geometry and rendering kernels in isolation:
+ * screen lookup, cursor gliding, virtual cursor updates, global space
+ * recalculation and cursor drawing. Each kernel runs against a set of
+ * synthetic output layouts with a fixed, seeded stream of motion that mixes
+ * small movements, long flicks, and pushes against the layout's walls.
+ *
+ * Results are printed one "kloak microbench:" line per layout and kernel.
+ * Some kernels are also timed against a plain reference implementation, so
+ * that changes to the optimized version can be compared against a baseline.
+ * The per-pixel glide reference is slow and only timed with --perpixel.
+ */
+
+#define KLOAK_BENCH
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "kloak.c"
+
+#define MICROBENCH_DEFAULT_ITERATIONS 100000
+/* Moves of each kind checked against the per-pixel walk without --perpixel */
+#define MICROBENCH_CHECKED_MOVES 2000
+#define MICROBENCH_MAX_OUTPUTS 4
+#define MICROBENCH_SEED 0x6b6c6f616bULL
+#define MICROBENCH_BUF_WIDTH 1920
+#define MICROBENCH_BUF_HEIGHT 1080
+
+/*
+ * A synthetic output layout. Geometry is in logical compositor coordinates,
+ * so a scaled output shows up as its logical size.
+ */
+struct microbench_layout {
+  const char *name;
+  size_t count;
+  struct output_geometry outputs[MICROBENCH_MAX_OUTPUTS];
+};
+
+/*
+ * Kinds of motion in the synthetic stream.
+ */
+enum microbench_motion {
+  MICROBENCH_MOTION_SHORT,
+  MICROBENCH_MOTION_FLICK,
+  MICROBENCH_MOTION_WALL,
+  MICROBENCH_MOTION_MIXED,
+};
+
+/*
+ * A precomputed cursor movement, as update_virtual_cursor() would see it.
+ */
+struct microbench_move {
+  struct coord start;
+  struct coord end;
+};
+
+/*
+ * A move that ends up somewhere else since the walk stopped using
+ * traverse_line()'s double precision slope. expected is where glide_cursor()
+ * and the per-pixel walk over the exact line end up, float_result is where
+ * the per-pixel walk over the old line did.
+ */
+struct microbench_glide_case {
+  const char *layout;
+  struct coord start;
+  struct coord end;
+  struct coord expected;
+  struct coord float_result;
+};
+
+static const struct microbench_layout microbench_layouts[] = {
+  {
+    .name = "single-1080p",
+    .count = 1,
+    .outputs = { { 0, 0, 1920, 1080 } },
+  },
+  {
+    .name = "3x4k",
+    .count = 3,
+    .outputs = {
+      { 0, 0, 3840, 2160 },
+      { 3840, 0, 3840, 2160 },
+      { 7680, 0, 3840, 2160 },
+    },
+  },
+  {
+    /* The upper right quadrant is a void the cursor has to glide around. */
+    .name = "l-shaped",
+    .count = 3,
+    .outputs = {
+      { 0, 0, 1920, 1080 },
+      { 0, 1080, 1920, 1080 },
+      { 1920, 1080, 1920, 1080 },
+    },
+  },
+  {
+    .name = "stacked",
+    .count = 2,
+    .outputs = {
+      { 0, 0, 2560, 1440 },
+      { 320, 1440, 1920, 1080 },
+    },
+  },
+  {
+    /* A 4K panel at scale 2, a 1440p panel at scale 1 and a 1080p laptop
+     * at scale 1.5, bottom-aligned against each other. */
+    .name = "mixed-scale",
+    .count = 3,
+    .outputs = {
+      { 0, 360, 1920, 1080 },
+      { 1920, 0, 2560, 1440 },
+      { 4480, 720, 1280, 720 },
+    },
+  },
+};
+
+/*
+ * Where pos * minor / major is a whole number, the old line computed it in
+ * double precision as slightly less and truncated it one pixel short. At
+ * the end point this made the walk miss the end, carry on past it and end
+ * up on no screen at all. Halfway along it decides whether a diagonal step
+ * slips past the corner where two screens meet.
+ */
+static const struct microbench_glide_case microbench_glide_cases[] = {
+  /* Short by one at the end point, the old walk ends in the void. */
+  { "l-shaped", { 1731, 869 }, { 1920, 1079 }, { 1919, 1079 },
+    { 1920, 1079 } },
+  { "stacked", { 430, 1317 }, { 0, 1440 }, { 0, 1439 }, { 0, 1440 } },
+  { "mixed-scale", { 2105, 352 }, { 1919, 0 }, { 1920, 0 }, { 1919, 0 } },
+  /* The exact line passes the corner at 1919,1079, the old one hit the void
+   * at 1920,1079 and glided along the lower screen's top edge. */
+  { "l-shaped", { 2301, 1475 }, { 1537, 683 }, { 1537, 683 },
+    { 1537, 1080 } },
+  /* The exact line hits the void at 1920,1079 and glides down the right
+   * edge of the lower left screen, the old one slipped past the corner. */
+  { "l-shaped", { 1740, 799 }, { 2091, 1345 }, { 1919, 1345 },
+    { 2091, 1345 } },
+};
+
+static size_t microbench_iterations = MICROBENCH_DEFAULT_ITERATIONS;
+/* --perpixel, also time the per-pixel glide reference */
+static bool microbench_perpixel = false;
+static uint64_t microbench_rng = MICROBENCH_SEED;
+static struct microbench_move *microbench_moves = NULL;
+static struct coord *microbench_points = NULL;
+/* Results are folded into this so the compiler can't drop the calls. */
+static volatile int64_t microbench_sink = 0;
+
+static uint64_t microbench_random(void) {
+  /* xorshift64*, deterministic so that every run times the same input */
+  microbench_rng ^= microbench_rng >> 12;
+  microbench_rng ^= microbench_rng << 25;
+  microbench_rng ^= microbench_rng >> 27;
+  return microbench_rng * 0x2545f4914f6cdd1dULL;
+}
+
+static int32_t microbench_random_between(int32_t lo, int32_t hi) {
+  return lo + (int32_t) (microbench_random() % (uint64_t) (hi - lo + 1));
+}
+
+static int32_t microbench_random_sign(void) {
+  return (microbench_random() & 1) ? 1 : -1;
+}
+
+static void microbench_set_layout(const struct microbench_layout *layout) {
+  while (state.layer_count > 0) {
+    struct drawable_layer *layer = state.layers[state.layer_count - 1];
+    remove_drawable_layer(&state, layer);
+    free(layer);
+  }
+  for (size_t i = 0; i < layout->count; ++i) {
+    struct drawable_layer *layer = calloc(1, sizeof(struct drawable_layer));
+    if (layer == NULL) {
+      fprintf(stderr,
+        "FATAL ERROR: Could not allocate memory for drawable layer!\n");
+      exit(1);
+    }
+    layer->state = &state;
+    insert_drawable_layer(&state, layer);
+    layer->geometry = layout->outputs[i];
+    layer->geometry_valid = true;
+  }
+  schedule_global_space_recalc(&state, true);
+  recalc_global_space(&state);
+}
+
+static struct coord microbench_layout_center(void) {
+  struct output_geometry *geometry = &state.layers[0]->geometry;
+  struct coord out_val = {
+    .x = geometry->x + geometry->width / 2,
+    .y = geometry->y + geometry->height / 2,
+  };
+  return out_val;
+}
+
+static struct coord microbench_motion_vector(enum microbench_motion kind) {
+  struct coord out_val;
+  if (kind == MICROBENCH_MOTION_MIXED) {
+    /* Mostly small movement, with the odd flick and wall push. */
+    uint64_t roll = microbench_random() % 10;
+    kind = roll < 7 ? MICROBENCH_MOTION_SHORT
+      : roll < 9 ? MICROBENCH_MOTION_FLICK : MICROBENCH_MOTION_WALL;
+  }
+  if (kind == MICROBENCH_MOTION_SHORT) {
+    out_val.x = microbench_random_between(-16, 16);
+    out_val.y = microbench_random_between(-16, 16);
+  } else if (kind == MICROBENCH_MOTION_FLICK) {
+    out_val.x = microbench_random_sign()
+      * microbench_random_between(500, 4000);
+    out_val.y = microbench_random_sign()
+      * microbench_random_between(0, 2000);
+    if (microbench_random() & 1) {
+      int32_t tmp = out_val.x;
+      out_val.x = out_val.y;
+      out_val.y = tmp;
+    }
+  } else {
+    /* Far past the edge of the global space along one axis, slightly
+     * sideways along the other, so the walk ends up at a wall, or gliding
+     * along one around a void. */
+    int32_t far_x = (int32_t) state.global_space_width * 2;
+    int32_t far_y = (int32_t) state.global_space_height * 2;
+    int32_t drift = microbench_random_sign()
+      * microbench_random_between(0, 200);
+    if (microbench_random() & 1) {
+      out_val.x = microbench_random_sign() * far_x;
+      out_val.y = drift;
+    } else {
+      out_val.x = drift;
+      out_val.y = microbench_random_sign() * far_y;
+    }
+  }
+  return out_val;
+}
+
+/*
+ * Fills microbench_moves with a chain of movements of the given kind, each
+ * starting where glide_cursor() left the previous one. End points are
+ * clamped to the global space, like relative motion is before it reaches
+ * update_virtual_cursor().
+ */
+static void microbench_make_moves(enum microbench_motion kind) {
+  struct coord pos = microbench_layout_center();
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    struct coord vec = microbench_motion_vector(kind);
+    struct coord end = {
+      .x = min(max(pos.x + vec.x, (int32_t) state.pointer_space_x),
+        (int32_t) state.global_space_width - 1),
+      .y = min(max(pos.y + vec.y, (int32_t) state.pointer_space_y),
+        (int32_t) state.global_space_height - 1),
+    };
+    microbench_moves[i].start = pos;
+    microbench_moves[i].end = end;
+    pos = glide_cursor(pos, end);
+  }
+}
+
+/*
+ * Fills microbench_points with points spread uniformly over the global
+ * space's bounding box, voids included.
+ */
+static void microbench_make_points(void) {
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    microbench_points[i].x = microbench_random_between(
+      (int32_t) state.pointer_space_x,
+      (int32_t) state.global_space_width - 1);
+    microbench_points[i].y = microbench_random_between(
+      (int32_t) state.pointer_space_y,
+      (int32_t) state.global_space_height - 1);
+  }
+}
+
+static void microbench_report(const char *layout, const char *kernel,
+  uint64_t calls, int64_t elapsed_ns) {
+  fprintf(stderr,
+    "kloak microbench: layout=%s kernel=%s calls=%" PRIu64
+    " ns_per_call=%.1f\n",
+    layout, kernel, calls, calls ? (double) elapsed_ns / (double) calls : 0);
+}
+
+/*
+ * Reference for abs_coord_to_screen_local_coord(): a linear scan over the
+ * layers, with no index and no last-hit shortcut.
+ */
+static struct screen_local_coord microbench_linear_lookup(int32_t x,
+  int32_t y) {
+  struct screen_local_coord out_data = { 0 };
+  for (size_t i = 0; i < state.layer_count; ++i) {
+    struct output_geometry *geometry = &state.layers[i]->geometry;
+    if (!state.layers[i]->geometry_valid || x < geometry->x
+      || y < geometry->y || x >= geometry->x + (int32_t) geometry->width
+      || y >= geometry->y + (int32_t) geometry->height)
+      continue;
+    out_data.output_idx = (int32_t) i;
+    out_data.x = x - geometry->x;
+    out_data.y = y - geometry->y;
+    out_data.valid = true;
+    break;
+  }
+  return out_data;
+}
+
+/*
+ * The line used by glide_cursor(), one position at a time, for
+ * microbench_perpixel_glide().
+ */
+static struct coord microbench_exact_line(struct coord start,
+  struct coord end, int32_t pos) {
+  struct line_iter iter;
+  line_iter_init(&iter, start, end);
+  return line_iter_coord_at(&iter, pos);
+}
+
+/*
+ * traverse_line() as it was before glide_cursor() switched to struct
+ * line_iter, for microbench_perpixel_glide().
+ */
+static struct coord microbench_float_line(struct coord start,
+  struct coord end, int32_t pos) {
+  if (pos == 0) return start;
+  struct coord out_val = { 0 };
+
+  double num = ((double) end.y) - ((double) start.y);
+  double denom = ((double) start.x) - ((double) end.x);
+  if (denom == 0) {
+    /* vertical line */
+    out_val.x = start.x;
+    if (start.y < end.y) {
+      out_val.y = start.y + pos;
+    } else {
+      out_val.y = start.y - pos;
+    }
+    return out_val;
+  }
+
+  double slope = num / denom;
+  double steep;
+  if (slope < 0)
+    steep = -slope;
+  else
+    steep = slope;
+
+  if (steep < 1) {
+    if (start.x < end.x) {
+      out_val.x = start.x + pos;
+    } else {
+      out_val.x = start.x - pos;
+    }
+    if (start.y < end.y) {
+      out_val.y = start.y + (int32_t)((double) pos * steep);
+    } else {
+      out_val.y = start.y - (int32_t)((double) pos * steep);
+    }
+  } else {
+    if (start.y < end.y) {
+      out_val.y = start.y + pos;
+    } else {
+      out_val.y = start.y - pos;
+    }
+    if (start.x < end.x) {
+      out_val.x = start.x + (int32_t)((double) pos * (1 / steep));
+    } else {
+      out_val.x = start.x - (int32_t)((double) pos * (1 / steep));
+    }
+  }
+
+  return out_val;
+}
+
+/*
+ * Reference for glide_cursor(): the edge-gliding walk as it used to be done
+ * in update_virtual_cursor(), looking up every pixel on the way. line gives
+ * the point pos pixels along the walk from start to end.
+ */
+static struct coord microbench_perpixel_glide(struct coord start,
+  struct coord end,
+  struct coord (*line)(struct coord start, struct coord end, int32_t pos)) {
+  struct coord prev_trav_coord = start;
+  bool end_x_hit = false;
+  bool end_y_hit = false;
+  for (int32_t i = 0; ; ++i) {
+    struct coord trav_coord = line(start, end, i);
+    if (trav_coord.x == end.x) end_x_hit = true;
+    if (trav_coord.y == end.y) end_y_hit = true;
+    struct screen_local_coord trav_scr_coord
+      = abs_coord_to_screen_local_coord(trav_coord.x, trav_coord.y);
+    if (!trav_scr_coord.valid) {
+      if (prev_trav_coord.x < trav_coord.x) {
+        trav_scr_coord = abs_coord_to_screen_local_coord(trav_coord.x - 1,
+          trav_coord.y);
+        if (trav_scr_coord.valid) {
+          start.x = trav_coord.x - 1;
+          start.y = trav_coord.y;
+          end.x = trav_coord.x - 1;
+          i = -1;
+          continue;
+        }
+      }
+      if (prev_trav_coord.x > trav_coord.x) {
+        trav_scr_coord = abs_coord_to_screen_local_coord(trav_coord.x + 1,
+          trav_coord.y);
+        if (trav_scr_coord.valid) {
+          start.x = trav_coord.x + 1;
+          start.y = trav_coord.y;
+          end.x = trav_coord.x + 1;
+          i = -1;
+          continue;
+        }
+      }
+      if (prev_trav_coord.y < trav_coord.y) {
+        trav_scr_coord = abs_coord_to_screen_local_coord(trav_coord.x,
+          trav_coord.y - 1);
+        if (trav_scr_coord.valid) {
+          start.y = trav_coord.y - 1;
+          start.x = trav_coord.x;
+          end.y = trav_coord.y - 1;
+          i = -1;
+          continue;
+        }
+      }
+      if (prev_trav_coord.y > trav_coord.y) {
+        trav_scr_coord = abs_coord_to_screen_local_coord(trav_coord.x,
+          trav_coord.y + 1);
+        if (trav_scr_coord.valid) {
+          start.y = trav_coord.y + 1;
+          start.x = trav_coord.x;
+          end.y = trav_coord.y + 1;
+          i = -1;
+          continue;
+        }
+      }
+    }
+    if (end_x_hit && end_y_hit)
+      return end;
+    prev_trav_coord = trav_coord;
+  }
+}
+
+static void microbench_lookup(const char *layout) {
+  int64_t start;
+  int64_t sum = 0;
+
+  /* Both versions have to agree before their timings mean anything. */
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    struct screen_local_coord a = abs_coord_to_screen_local_coord(
+      microbench_points[i].x, microbench_points[i].y);
+    struct screen_local_coord b = microbench_linear_lookup(
+      microbench_points[i].x, microbench_points[i].y);
+    if (a.valid != b.valid || (a.valid && (a.output_idx != b.output_idx
+      || a.x != b.x || a.y != b.y))) {
+      fprintf(stderr,
+        "FATAL ERROR: Screen lookup mismatch at %d,%d on layout %s!\n",
+        microbench_points[i].x, microbench_points[i].y, layout);
+      exit(1);
+    }
+  }
+
+  start = current_time_ns();
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    sum += abs_coord_to_screen_local_coord(microbench_points[i].x,
+      microbench_points[i].y).x;
+  }
+  microbench_report(layout, "lookup_scattered", microbench_iterations,
+    current_time_ns() - start);
+
+  start = current_time_ns();
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    sum += microbench_linear_lookup(microbench_points[i].x,
+      microbench_points[i].y).x;
+  }
+  microbench_report(layout, "lookup_scattered_linear", microbench_iterations,
+    current_time_ns() - start);
+
+  /* Cursor-like access: every point is near the previous one. */
+  microbench_make_moves(MICROBENCH_MOTION_SHORT);
+  start = current_time_ns();
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    sum += abs_coord_to_screen_local_coord(microbench_moves[i].start.x,
+      microbench_moves[i].start.y).x;
+  }
+  microbench_report(layout, "lookup_coherent", microbench_iterations,
+    current_time_ns() - start);
+
+  start = current_time_ns();
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    sum += microbench_linear_lookup(microbench_moves[i].start.x,
+      microbench_moves[i].start.y).x;
+  }
+  microbench_report(layout, "lookup_coherent_linear", microbench_iterations,
+    current_time_ns() - start);
+  microbench_sink += sum;
+}
+
+static void microbench_glide(const char *layout) {
+  static const struct {
+    enum microbench_motion kind;
+    const char *kernel;
+    const char *reference;
+  } kinds[] = {
+    { MICROBENCH_MOTION_SHORT, "glide_short", "glide_short_perpixel" },
+    { MICROBENCH_MOTION_FLICK, "glide_flick", "glide_flick_perpixel" },
+    { MICROBENCH_MOTION_WALL, "glide_wall", "glide_wall_perpixel" },
+    { MICROBENCH_MOTION_MIXED, "glide_mixed", "glide_mixed_perpixel" },
+  };
+  int64_t sum = 0;
+  /* The per-pixel walk takes microseconds for a long move, so unless it is
+   * timed as well, only the start of each move stream is checked. */
+  size_t checked = microbench_perpixel ? microbench_iterations
+    : min(microbench_iterations, (size_t) MICROBENCH_CHECKED_MOVES);
+
+  /* The moves whose results changed with the exact line stay changed. */
+  for (size_t i = 0;
+    i < sizeof(microbench_glide_cases) / sizeof(microbench_glide_cases[0]);
+    ++i) {
+    const struct microbench_glide_case *gcase = &microbench_glide_cases[i];
+    if (strcmp(gcase->layout, layout) != 0)
+      continue;
+    struct coord a = glide_cursor(gcase->start, gcase->end);
+    struct coord b = microbench_perpixel_glide(gcase->start, gcase->end,
+      microbench_exact_line);
+    struct coord c = microbench_perpixel_glide(gcase->start, gcase->end,
+      microbench_float_line);
+    if (a.x != gcase->expected.x || a.y != gcase->expected.y
+      || b.x != gcase->expected.x || b.y != gcase->expected.y
+      || c.x != gcase->float_result.x || c.y != gcase->float_result.y) {
+      fprintf(stderr,
+        "FATAL ERROR: Glide case from %d,%d to %d,%d on layout %s ended at"
+        " %d,%d, %d,%d per pixel and %d,%d on the old line!\n",
+        gcase->start.x, gcase->start.y, gcase->end.x, gcase->end.y, layout,
+        a.x, a.y, b.x, b.y, c.x, c.y);
+      exit(1);
+    }
+  }
+
+  for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); ++k) {
+    microbench_make_moves(kinds[k].kind);
+    /* glide_cursor() skips most of the walk, but has to end up where the
+     * per-pixel walk does. */
+    for (size_t i = 0; i < checked; ++i) {
+      struct microbench_move *move = &microbench_moves[i];
+      struct coord a = glide_cursor(move->start, move->end);
+      struct coord b = microbench_perpixel_glide(move->start, move->end,
+        microbench_exact_line);
+      if (a.x != b.x || a.y != b.y) {
+        fprintf(stderr,
+          "FATAL ERROR: Glide mismatch from %d,%d to %d,%d on layout %s:"
+          " %d,%d instead of %d,%d!\n",
+          move->start.x, move->start.y, move->end.x, move->end.y, layout,
+          a.x, a.y, b.x, b.y);
+        exit(1);
+      }
+    }
+    int64_t start = current_time_ns();
+    for (size_t i = 0; i < microbench_iterations; ++i) {
+      struct coord end = glide_cursor(microbench_moves[i].start,
+        microbench_moves[i].end);
+      sum += end.x + end.y;
+    }
+    microbench_report(layout, kinds[k].kernel, microbench_iterations,
+      current_time_ns() - start);
+
+    if (!microbench_perpixel)
+      continue;
+    start = current_time_ns();
+    for (size_t i = 0; i < microbench_iterations; ++i) {
+      struct coord end = microbench_perpixel_glide(microbench_moves[i].start,
+        microbench_moves[i].end, microbench_exact_line);
+      sum += end.x + end.y;
+    }
+    microbench_report(layout, kinds[k].reference, microbench_iterations,
+      current_time_ns() - start);
+  }
+  microbench_sink += sum;
+}
+
+static void microbench_update_cursor(const char *layout) {
+  struct seat_context *seat = &seats[0];
+  microbench_make_moves(MICROBENCH_MOTION_MIXED);
+  /* Every call after the first folds into the same queued motion packet,
+   * which is what a burst of mouse movement looks like. */
+  seat->packet_queue.first = 0;
+  seat->packet_queue.len = 0;
+
+  int64_t start = current_time_ns();
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    seat->prev_cursor_x = microbench_moves[i].start.x;
+    seat->prev_cursor_y = microbench_moves[i].start.y;
+    seat->cursor_x = microbench_moves[i].end.x;
+    seat->cursor_y = microbench_moves[i].end.y;
+    update_virtual_cursor(seat, (uint32_t) i);
+  }
+  microbench_report(layout, "update_virtual_cursor", microbench_iterations,
+    current_time_ns() - start);
+}
+
+static void microbench_recalc(const char *layout) {
+  /* A full rebuild, as after an output moves or disappears. */
+  int64_t start = current_time_ns();
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    schedule_global_space_recalc(&state, true);
+    recalc_global_space(&state);
+  }
+  microbench_report(layout, "recalc_global_space", microbench_iterations,
+    current_time_ns() - start);
+}
+
+static void microbench_draw(void) {
+  uint32_t *pixbuf = calloc((size_t) MICROBENCH_BUF_WIDTH
+    * MICROBENCH_BUF_HEIGHT, sizeof(uint32_t));
+  if (pixbuf == NULL) {
+    fprintf(stderr,
+      "FATAL ERROR: Could not allocate memory for pixel buffer!\n");
+    exit(1);
+  }
+  /* Positions run a little past every edge, so clipping is exercised. */
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    microbench_points[i].x = microbench_random_between(-CURSOR_RADIUS,
+      MICROBENCH_BUF_WIDTH + CURSOR_RADIUS);
+    microbench_points[i].y = microbench_random_between(-CURSOR_RADIUS,
+      MICROBENCH_BUF_HEIGHT + CURSOR_RADIUS);
+  }
+
+  int64_t start = current_time_ns();
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    clear_block(pixbuf, microbench_points[i].x, microbench_points[i].y,
+      MICROBENCH_BUF_WIDTH, MICROBENCH_BUF_HEIGHT, cursor_sprite.rad);
+  }
+  microbench_report("buffer-1080p", "clear_block", microbench_iterations,
+    current_time_ns() - start);
+
+  start = current_time_ns();
+  for (size_t i = 0; i < microbench_iterations; ++i) {
+    blit_sprite(pixbuf, microbench_points[i].x, microbench_points[i].y,
+      MICROBENCH_BUF_WIDTH, MICROBENCH_BUF_HEIGHT, &cursor_sprite);
+  }
+  microbench_report("buffer-1080p", "blit_sprite", microbench_iterations,
+    current_time_ns() - start);
+  microbench_sink += pixbuf[MICROBENCH_BUF_WIDTH / 2];
+  free(pixbuf);
+}
+
+static void microbench_print_usage(void) {
+  fprintf(stderr,
+    "Usage: kloak-microbench [options]\n");
+  fprintf(stderr,
+    "Times kloak's geometry and rendering kernels against synthetic output\n");
+  fprintf(stderr,
+    "layouts.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr,
+    "Options:\n");
+  fprintf(stderr,
+    "  -n, --iterations=count            calls per kernel. Default 100000.\n");
+  fprintf(stderr,
+    "  -l, --layout=name                 only run the named layout, one of\n");
+  fprintf(stderr,
+    "                                    single-1080p, 3x4k, l-shaped,\n");
+  fprintf(stderr,
+    "                                    stacked or mixed-scale.\n");
+  fprintf(stderr,
+    "  -p, --perpixel                    also time the per-pixel glide walk\n");
+  fprintf(stderr,
+    "                                    and check every move against it.\n");
+  fprintf(stderr,
+    "                                    Slow. Without it, the first 2000\n");
+  fprintf(stderr,
+    "                                    moves of each kind are checked.\n");
+  fprintf(stderr,
+    "  -h, --help                        print help\n");
+}
+
+int main(int argc, char **argv) {
+  const char *optstring = "n:l:ph";
+  const char *only_layout = NULL;
+  static struct option optarr[] = {
+    {"iterations", required_argument, NULL, 'n'},
+    {"layout", required_argument, NULL, 'l'},
+    {"perpixel", no_argument, NULL, 'p'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0}
+  };
+  int getopt_rslt;
+
+  while(1) {
+    getopt_rslt = getopt_long(argc, argv, optstring, optarr, NULL);
+    if (getopt_rslt == -1) {
+      break;
+    } else if (getopt_rslt == 'n') {
+      microbench_iterations = (size_t) parse_uintarg("iterations", optarg);
+    } else if (getopt_rslt == 'l') {
+      only_layout = optarg;
+    } else if (getopt_rslt == 'p') {
+      microbench_perpixel = true;
+    } else if (getopt_rslt == 'h') {
+      microbench_print_usage();
+      exit(0);
+    } else {
+      microbench_print_usage();
+      exit(1);
+    }
+  }
+  if (microbench_iterations == 0) {
+    fprintf(stderr, "FATAL ERROR: --iterations must be at least 1!\n");
+    exit(1);
+  }
+
+  microbench_moves = calloc(microbench_iterations,
+    sizeof(struct microbench_move));
+  microbench_points = calloc(microbench_iterations, sizeof(struct coord));
+  if (microbench_moves == NULL || microbench_points == NULL) {
+    fprintf(stderr,
+      "FATAL ERROR: Could not allocate memory for benchmark input!\n");
+    exit(1);
+  }
+  applayer_random_init();
+  applayer_cursor_init();
+  add_seat(DEFAULT_SEAT);
+  packet_ring_init(&seats[0].packet_queue, PACKET_RING_INITIAL_CAPACITY);
+
+  bool matched = false;
+  for (size_t i = 0;
+    i < sizeof(microbench_layouts) / sizeof(microbench_layouts[0]); ++i) {
+    const struct microbench_layout *layout = &microbench_layouts[i];
+    if (only_layout && strcmp(only_layout, layout->name) != 0)
+      continue;
+    matched = true;
+    microbench_set_layout(layout);
+    microbench_make_points();
+    microbench_lookup(layout->name);
+    microbench_glide(layout->name);
+    microbench_update_cursor(layout->name);
+    microbench_recalc(layout->name);
+  }
+  if (!matched) {
+    fprintf(stderr, "FATAL ERROR: Unknown layout '%s'!\n", only_layout);
+    exit(1);
+  }
+  microbench_draw();
+  return 0;
+}